@@ -0,0 +1,227 @@
+// Micro-benchmark of the byte stuffing and destuffing of I frames (src/stuffing.c)
+// against the per-byte loops they replaced, on random payloads and on payloads made
+// only of FLAG bytes, the worst case. Both are checked to give the same output and
+// BCC2 first.
+//
+// Build: gcc -Wall -O2 -Iinclude -o bin/bench_stuffing bench/stuffing.c src/stuffing.c
+//        (without -O2 to measure the code as the Makefile builds it)
+// Usage: ./bin/bench_stuffing [payload size] [megabytes]
+
+#include "stuffing.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FLAG 0x7E
+#define ESCAPE 0x7D
+
+#define DEFAULT_PAYLOAD 1004  // MAX_PAYLOAD_SIZE bytes of data behind a packet header
+#define DEFAULT_MEGABYTES 200
+#define MAX_PAYLOAD 65535
+
+// Keeps the compiler from dropping the work whose result is never used
+volatile unsigned char sink;
+
+
+// Stuffing of the original llwrite, one byte at a time
+int stuff_switch(unsigned char *out, const unsigned char *data, int size, unsigned char *bcc2)
+{
+    unsigned char xor = *bcc2;
+    int idx = 0;
+    for (int i = 0; i < size; i++)
+    {
+        switch (data[i])
+        {
+            case ESCAPE:
+                out[idx++] = ESCAPE;
+                out[idx++] = ESCAPE ^ 0x20;
+                break;
+            case FLAG:
+                out[idx++] = ESCAPE;
+                out[idx++] = FLAG ^ 0x20;
+                break;
+            default:
+                out[idx++] = data[i];
+                break;
+        }
+        xor ^= data[i];
+    }
+    *bcc2 = xor;
+    return idx;
+}
+
+
+// Destuffing of the original llread state machine, one byte at a time, then its
+// separate BCC2 pass over the data
+int destuff_loop(unsigned char *out, const unsigned char *in, int size, unsigned char *bcc2)
+{
+    int idx = 0;
+    int escaped = 0;
+    for (int i = 0; i < size; i++)
+    {
+        if (escaped)
+        {
+            if (in[i] == (FLAG ^ 0x20))
+            {
+                out[idx++] = FLAG;
+            }
+            else if (in[i] == (ESCAPE ^ 0x20))
+            {
+                out[idx++] = ESCAPE;
+            }
+            escaped = 0;
+        }
+        else if (in[i] == ESCAPE)
+        {
+            escaped = 1;
+        }
+        else
+        {
+            out[idx++] = in[i];
+        }
+    }
+
+    unsigned char xor = *bcc2;
+    for (int i = 0; i < idx; i++)
+    {
+        xor ^= out[i];
+    }
+    *bcc2 = xor;
+    return idx;
+}
+
+
+// destuffBytes with the signature of the other functions
+int destuff_bulk(unsigned char *out, const unsigned char *in, int size, unsigned char *bcc2)
+{
+    int outSize;
+    destuffBytes(out, MAX_PAYLOAD, &outSize, in, size, bcc2);
+    return outSize;
+}
+
+
+double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+// Fill data with random bytes, each reserved (FLAG or ESCAPE) with the given percentage
+void fill(unsigned char *data, int size, int reservedPercent)
+{
+    for (int i = 0; i < size; i++)
+    {
+        if (rand() % 100 < reservedPercent)
+        {
+            data[i] = rand() % 2 ? FLAG : ESCAPE;
+        }
+        else
+        {
+            do
+            {
+                data[i] = rand();
+            } while (data[i] == FLAG || data[i] == ESCAPE);
+        }
+    }
+}
+
+
+// Compare both implementations on random sizes and escape densities
+int check(void)
+{
+    static unsigned char data[MAX_PAYLOAD], expected[2 * MAX_PAYLOAD], out[2 * MAX_PAYLOAD];
+    const int densities[] = {0, 1, 10, 50, 100};
+    for (int round = 0; round < 2000; round++)
+    {
+        int size = round < 200 ? round : rand() % 4096;
+        fill(data, size, densities[round % 5]);
+        unsigned char bcc2Expected = 0, bcc2 = 0;
+        int expectedSize = stuff_switch(expected, data, size, &bcc2Expected);
+        int outSize = stuffBytes(out, data, size, &bcc2);
+        if (outSize != expectedSize || memcmp(out, expected, outSize) != 0 || bcc2 != bcc2Expected)
+        {
+            printf("Mismatch stuffing %d bytes with %d%% reserved\n", size, densities[round % 5]);
+            return -1;
+        }
+
+        bcc2 = 0;
+        outSize = destuff_bulk(out, expected, expectedSize, &bcc2);
+        if (outSize != size || memcmp(out, data, size) != 0 || bcc2 != bcc2Expected)
+        {
+            printf("Mismatch destuffing %d bytes with %d%% reserved\n", size, densities[round % 5]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// Run function repeatedly on the size bytes of in, which hold dataSize bytes of payload;
+// returns the throughput in MB/s of payload
+double measure(int (*function)(unsigned char *, const unsigned char *, int, unsigned char *),
+               const unsigned char *in, int size, int dataSize, long iterations)
+{
+    static unsigned char out[2 * MAX_PAYLOAD];
+    unsigned char bcc2 = 0;
+    double start = now();
+    for (long i = 0; i < iterations; i++)
+    {
+        function(out, in, size, &bcc2);
+        sink = out[0];
+    }
+    double elapsed = now() - start;
+    sink = bcc2;
+    return dataSize * (double)iterations / elapsed / 1e6;
+}
+
+
+// Print the throughput of both implementations of stuffing and destuffing data
+void compare(const char *name, const unsigned char *data, int size, long iterations)
+{
+    static unsigned char stuffed[2 * MAX_PAYLOAD];
+    unsigned char bcc2 = 0;
+    int stuffedSize = stuff_switch(stuffed, data, size, &bcc2);
+
+    printf("  %-9s %11.0f %11.0f %11.0f %11.0f\n", name,
+           measure(stuff_switch, data, size, size, iterations),
+           measure(stuffBytes, data, size, size, iterations),
+           measure(destuff_loop, stuffed, stuffedSize, size, iterations),
+           measure(destuff_bulk, stuffed, stuffedSize, size, iterations));
+}
+
+
+int main(int argc, char *argv[])
+{
+    int size = argc > 1 ? atoi(argv[1]) : DEFAULT_PAYLOAD;
+    long megabytes = argc > 2 ? atol(argv[2]) : DEFAULT_MEGABYTES;
+    if (size < 1 || size > MAX_PAYLOAD || megabytes < 1)
+    {
+        printf("Usage: %s [payload size, 1 to %d] [megabytes]\n", argv[0], MAX_PAYLOAD);
+        exit(-1);
+    }
+    long iterations = megabytes * 1000000 / size + 1;
+
+    srand(1);
+    if (check() != 0)
+    {
+        exit(-1);
+    }
+
+    static unsigned char data[MAX_PAYLOAD];
+    printf("%d byte payloads, %ld MB each (MB/s of payload)\n", size, megabytes);
+    printf("            switch loop  stuffBytes   byte loop destuffBytes\n");
+
+    for (int i = 0; i < size; i++)
+    {
+        data[i] = rand();
+    }
+    compare("random", data, size, iterations);
+
+    memset(data, FLAG, size);
+    compare("all FLAG", data, size, iterations);
+
+    return 0;
+}
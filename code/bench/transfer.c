@@ -0,0 +1,237 @@
+// Benchmark of whole file transfers: runs the receiver and the transmitter (bin/main)
+// on two pseudo terminals relayed back to back with no delay, so the time measured is
+// what both ends spend, and checks that the file arrived intact. Reports the wall time of
+// the transmitter and the CPU time (user + system) of each end. The link layer options
+// are taken from the environment as usual (LL_PAYLOAD, LL_WINDOW, ...).
+//
+// Build: gcc -Wall -o bin/bench_transfer bench/transfer.c
+// Usage: ./bin/bench_transfer [-n runs] [-m main program] <file>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FALSE 0
+#define TRUE 1
+
+#define BUF_SIZE 65536
+#define BAUD_RATE "115200"        // Only sets the timeouts, the relay does not delay bytes
+#define RECEIVED_FILE "/tmp/bench_transfer.received"
+#define RECEIVER_START_US 200000  // Head start of the receiver, so the first SET is answered
+
+// One end of the relay: a pseudo terminal master and the bytes waiting to be written to it
+struct End
+{
+    int master;
+    int slave;  // Kept open so the master does not hang up between runs
+    char name[64];
+    char pending[BUF_SIZE];
+    int count;
+};
+
+struct End ends[2];
+
+
+double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+void open_end(struct End *end)
+{
+    struct termios raw;
+    if (openpty(&end->master, &end->slave, end->name, NULL, NULL) != 0)
+    {
+        perror("openpty");
+        exit(-1);
+    }
+    cfmakeraw(&raw);
+    tcsetattr(end->slave, TCSANOW, &raw);
+    fcntl(end->master, F_SETFL, O_NONBLOCK);
+}
+
+
+// Start program with the given arguments, its output discarded
+pid_t start(char *const argv[])
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+
+// Measures of a run
+struct Run
+{
+    double transmitterEnd;  // Time the transmitter exited
+    double transmitterCpu;  // CPU time of the transmitter (s)
+    double receiverCpu;     // CPU time of the receiver (s)
+};
+
+
+// Move bytes between both ends until both programs exit
+void relay(pid_t receiver, pid_t transmitter, struct Run *run)
+{
+    int running = 2;
+    while (running > 0)
+    {
+        struct pollfd pfd[2];
+        for (int i = 0; i < 2; i++)
+        {
+            pfd[i].fd = ends[i].master;
+            pfd[i].events = (ends[1 - i].count < BUF_SIZE ? POLLIN : 0) | (ends[i].count > 0 ? POLLOUT : 0);
+        }
+        poll(pfd, 2, 10);
+
+        for (int i = 0; i < 2; i++)
+        {
+            struct End *from = &ends[i], *to = &ends[1 - i];
+            if (pfd[i].revents & POLLIN)
+            {
+                int n = read(from->master, to->pending + to->count, BUF_SIZE - to->count);
+                to->count += n > 0 ? n : 0;
+            }
+            if (to->count > 0)
+            {
+                int n = write(to->master, to->pending, to->count);
+                if (n > 0)
+                {
+                    memmove(to->pending, to->pending + n, to->count - n);
+                    to->count -= n;
+                }
+            }
+        }
+
+        int status;
+        pid_t pid;
+        struct rusage usage;
+        while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+        {
+            double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec +
+                         usage.ru_stime.tv_usec / 1e6;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            {
+                printf("%s failed\n", pid == receiver ? "Receiver" : "Transmitter");
+                exit(-1);
+            }
+            if (pid == transmitter)
+            {
+                run->transmitterEnd = now();
+                run->transmitterCpu = cpu;
+            }
+            else
+            {
+                run->receiverCpu = cpu;
+            }
+            running--;
+        }
+    }
+    ends[0].count = ends[1].count = 0;
+}
+
+
+// Whether both files have the same contents
+int same_files(const char *a, const char *b)
+{
+    FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+    int same = fa != NULL && fb != NULL;
+    static char bufA[BUF_SIZE], bufB[BUF_SIZE];
+    while (same)
+    {
+        size_t na = fread(bufA, 1, BUF_SIZE, fa), nb = fread(bufB, 1, BUF_SIZE, fb);
+        same = na == nb && memcmp(bufA, bufB, na) == 0;
+        if (na == 0)
+        {
+            break;
+        }
+    }
+    if (fa != NULL)
+    {
+        fclose(fa);
+    }
+    if (fb != NULL)
+    {
+        fclose(fb);
+    }
+    return same;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int runs = 3;
+    char *program = "./bin/main";
+    int option;
+    while ((option = getopt(argc, argv, "n:m:")) != -1)
+    {
+        if (option == 'n' && atoi(optarg) > 0)
+        {
+            runs = atoi(optarg);
+        }
+        else if (option == 'm')
+        {
+            program = optarg;
+        }
+        else
+        {
+            printf("Usage: %s [-n runs] [-m main program] <file>\n", argv[0]);
+            exit(-1);
+        }
+    }
+    if (optind != argc - 1)
+    {
+        printf("Usage: %s [-n runs] [-m main program] <file>\n", argv[0]);
+        exit(-1);
+    }
+    char *file = argv[optind];
+
+    open_end(&ends[0]);
+    open_end(&ends[1]);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Run  Wall (s)  Tx CPU (s)  Rx CPU (s)\n");
+    for (int run = 1; run <= runs; run++)
+    {
+        unlink(RECEIVED_FILE);
+        unlink(RECEIVED_FILE ".journal");
+
+        char *receiverArgs[] = {program, ends[1].name, BAUD_RATE, "rx", RECEIVED_FILE, NULL};
+        char *transmitterArgs[] = {program, ends[0].name, BAUD_RATE, "tx", file, NULL};
+        pid_t receiver = start(receiverArgs);
+        usleep(RECEIVER_START_US);
+        double startTime = now();
+        struct Run measures = {0};
+        pid_t transmitter = start(transmitterArgs);
+        relay(receiver, transmitter, &measures);
+
+        if (!same_files(file, RECEIVED_FILE))
+        {
+            printf("%s was not received intact\n", file);
+            exit(-1);
+        }
+        printf("%3d  %8.3f  %10.3f  %10.3f\n", run, measures.transmitterEnd - startTime, measures.transmitterCpu,
+               measures.receiverCpu);
+    }
+    unlink(RECEIVED_FILE);
+    return 0;
+}
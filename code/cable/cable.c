@@ -1,16 +1,21 @@
 // Virtual cable program to test serial port.
-// Creates a pair of virtual Tx / Rx serial ports using "socat".
+// Creates a pair of virtual Tx / Rx serial ports (pseudo terminals).
 //
 // Author: Manuel Ricardo [mricardo@fe.up.pt]
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 // Modified by: Rui Prior [rcprior@fc.up.pt]
 
+#include <errno.h>
 #include <fcntl.h>
 #include <math.h>
-#include <sched.h>
+#include <poll.h>
+#include <pty.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <termios.h>
@@ -19,9 +24,6 @@
 
 #define TXDEV "/dev/ttyS10"
 #define RXDEV "/dev/ttyS11"
-// Baudrate settings are defined in <asm/termbits.h>, which is
-// included by <termios.h>
-#define BAUDRATE B9600         // For struct termios
 #define DEFAULT_BAUDRATE 9600  // For the delaying transmissions
 #define _POSIX_SOURCE 1        // POSIX compliant source
 #define FALSE 0
@@ -29,93 +31,395 @@
 
 #define BUF_SIZE 2048
 
+// Bytes are read from the serial ports ahead of the time the line would start sending
+// them by up to this much (nsec), so they are moved in batches instead of one per wakeup
+#define READ_AHEAD 1000000LL
+
+#define NEVER (-1LL)
+
+// Number of bits or bytes before an error that never happens
+#define NO_ERROR (1LL << 60)
+
+#define DEFAULT_SEED 1
+
+// Binary trace of the bytes (see cable/trace.c, whose copy of the layout this must
+// match): a header, then a record for each byte entering the cable, leaving it or lost
+// in it. Records are buffered and written in large blocks to keep tracing cheap.
+#define TRACE_MAGIC "CBLTRACE"
+#define TRACE_VERSION 1
+#define TRACE_RECORDS 65536  // Records buffered before a write (1 MB)
+
+#define TRACE_SENT 0x01       // Entered the cable from an end
+#define TRACE_DELIVERED 0x02  // Left the cable to the other end
+#define TRACE_CORRUPTED 0x04  // Delivered with wrong bits
+#define TRACE_INSERTED 0x08   // Spurious byte, delivered after the byte of its index
+#define TRACE_DELETED 0x10    // Lost, deleted by the noise
+#define TRACE_DROPPED 0x20    // Lost in a dropout
+#define TRACE_CUT 0x40        // Lost while the cable was off
+
+struct TraceHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int recordSize;
+};
+
+struct TraceRecord {
+    long long time;           // Since the trace started (nsec)
+    unsigned int index;       // Position of the byte among those sent in its direction
+    unsigned char direction;  // 0 for Tx->Rx, 1 for Rx->Tx
+    unsigned char flags;
+    unsigned char byte;       // As delivered, or as sent
+    unsigned char original;   // As sent
+};
+
+#define MAX_EVENTS 256
+#define COMMAND_SIZE 128
+
+// Virtual time (see include/vclock.h, whose layout this must match): the cable and
+// both ends share a clock file named by this variable, and the cable moves the clock
+// straight to the next event whenever neither end can act before it.
+#define VCLOCK_ENV "LL_VCLOCK"
+#define VCLOCK_TICK 50000 // How often the ends are checked, in nsec of real time
+
+struct VirtualClock {
+    long long now;
+    struct {
+        int attached;
+        unsigned int changes;
+        int polling;
+        int blocked;
+        int writing;
+        long long wakeAt;
+        unsigned long long written;
+        unsigned long long read;
+        unsigned long long received;
+        unsigned long long delivered;
+    } port[2];  // Transmitter (TXDEV) and receiver (RXDEV)
+};
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+
+// Channel model of one direction of the cable. Bit errors follow a Gilbert-Elliott
+// model: the line alternates between a good state and bursts, each with its own BER.
+// Bytes may also be deleted, spurious bytes inserted, and the line may drop everything
+// periodically. Errors are drawn as the number of bits or bytes until the next one, so
+// most bytes only decrement counters, from a seeded generator to make runs repeatable.
+struct Noise {
+    unsigned long long rng[4];  // xoshiro256** state
+    double ber;                 // Bit error rate outside bursts
+    double burstBer;            // Bit error rate during bursts
+    double burstLength;         // Mean length of the bursts in bytes, 0 for no bursts
+    double burstGap;            // Mean number of bytes between bursts
+    double deleteRate;          // Probability of a byte being lost
+    double insertRate;          // Probability of a spurious byte after a byte
+    long long dropPeriod;       // The line drops all bytes once every dropPeriod nsec,
+    long long dropLength;       // for dropLength nsec,
+    long long dropStart;        // starting at this time; no dropouts if dropPeriod is 0
+    int inBurst;
+    long long bytesToSwitch;    // Bytes before the burst starts or ends
+    long long bitsToError;      // Correct bits before the next wrong one
+    long long bytesToDelete;    // Bytes delivered before the next one is deleted
+    long long bytesToInsert;    // Bytes delivered before a spurious one
+    unsigned long long dropped;      // Bytes lost in dropouts
+    unsigned long long deleted;      // Bytes deleted
+    unsigned long long inserted;     // Spurious bytes
+    unsigned long long corrupted;    // Bytes with wrong bits
+    unsigned long long flippedBits;  // Wrong bits
+};
+
+// One direction of the cable. Bytes read from fdIn wait in the ring, timestamped with
+// the time they finish arriving at the other end, and are written to fdOut then.
+struct Line {
+    int fdIn;
+    int fdOut;
+    char *data;
+    long long *due;    // Time each byte is delivered (nsec)
+    long head;         // Oldest byte in the ring
+    long count;        // Bytes in the ring
+    long long freeAt;  // Time the line finishes sending the bytes already read (nsec)
+    int throttled;     // Bytes may be waiting in fdIn until the line is free
+    unsigned long long *received;   // Bytes read from fdIn, in the virtual clock
+    unsigned long long *delivered;  // Bytes written to fdOut, in the virtual clock
+    unsigned long long cut;         // Bytes lost while the cable was off
+    struct Noise noise;
+};
+
 // Current running parameters
 struct Parameters {
     int cableOn;
-    double byteER;   // Byte error rate
-    struct timespec byteDelay;
+    unsigned long baud;
+    long long byteDelay;       // Time to send a byte in nsec
     unsigned long propDelay;   // Desired propagation delay in usec
-    int bufSize;  // Dimensioned to enforce the propagation delay
-    char *tx2rx;
-    char *tx2rxValid;  // TRUE if corresponding entry holds a byte
-    long tx2rxIdx;     // Input index for the tx2rx buffer
-    char *rx2tx;
-    char *rx2txValid;  // TRUE if corresponding entry holds a byte
-    long rx2txIdx;     // Input index for the tx2rx buffer
-    FILE *logfile;
+    int bufSize;  // Dimensioned to hold the bytes in flight
+    struct Line tx2rx;
+    struct Line rx2tx;
+    int traceFd;               // Trace file, -1 if not tracing
+    long long traceStart;      // Time the trace started (nsec)
+    struct VirtualClock *vclock;  // NULL in real time
+    unsigned long long seed;
+    long long startTime;       // Time of the first byte received from either end (nsec)
+    long long lastDelivered;   // Time of the last byte delivered to either end (nsec)
+    const char *links[2];      // Paths the transmitter and the receiver open
+};
+
+// Scenario of a headless run: commands to run at set times after the first byte
+struct Event {
+    long long at;  // Time after the first byte (nsec), 0 to run when the cable starts
+    char command[COMMAND_SIZE];
+};
+
+struct Scenario {
+    struct Event events[MAX_EVENTS];  // Sorted by time
+    int count;
+    int next;  // First event not run yet
 };
 
 struct Parameters par = {
     .cableOn = TRUE,
-    .byteER = 0.0,
     .propDelay = 0,
-    .tx2rx = NULL,
-    .tx2rxValid = NULL,
-    .rx2tx = NULL,
-    .rx2txValid = NULL,
-    .logfile = NULL};
+    .tx2rx = {.data = NULL, .due = NULL},
+    .rx2tx = {.data = NULL, .due = NULL},
+    .traceFd = -1,
+    .vclock = NULL,
+    .startTime = NEVER,
+    .lastDelivered = NEVER,
+    .links = {TXDEV, RXDEV}};
+
+struct Scenario scenario = {.count = 0, .next = 0};
+
+// Records of the trace not written yet
+struct TraceRecord trace[TRACE_RECORDS];
+int traced = 0;
+
+// Byte counters of the ports while not in virtual time
+struct VirtualClock realTime;
 
-// Returns: serial port file descriptor (fd).
-int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
+// Current time in nsec, virtual or real
+long long now_nsec(void)
 {
-    int fd = open(serialPort, O_RDWR | O_NONBLOCK | O_NOCTTY);
+    if (par.vclock != NULL)
+    {
+        return LOAD(par.vclock->now);
+    }
 
-    if (fd < 0)
-        return -1;
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
 
-    // Save current port settings
-    if (tcgetattr(fd, oldtio) == -1)
-        return -1;
 
-    memset(newtio, 0, sizeof(*newtio));
-    newtio->c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
-    newtio->c_iflag = IGNPAR;
-    newtio->c_oflag = 0;
-    newtio->c_lflag = 0;
-    newtio->c_cc[VTIME] = 0; // Inter-character timer unused (polling mode)
-    newtio->c_cc[VMIN] = 0;  // Read without blocking
-    tcflush(fd, TCIOFLUSH);
+// Next number of a xoshiro256** generator
+unsigned long long next_random(unsigned long long *rng)
+{
+    unsigned long long x = rng[1] * 5;
+    unsigned long long result = (x << 7 | x >> 57) * 9;
+    unsigned long long t = rng[1] << 17;
+    rng[2] ^= rng[0];
+    rng[3] ^= rng[1];
+    rng[1] ^= rng[2];
+    rng[0] ^= rng[3];
+    rng[2] ^= t;
+    rng[3] = rng[3] << 45 | rng[3] >> 19;
+    return result;
+}
 
-    if (tcsetattr(fd, TCSANOW, newtio) == -1)
-        return -1;
 
-    return fd;
+// Natural logarithm of x > 0, without libm
+double ln(double x)
+{
+    // x = m * 2^e with m in [0.5, 1), and ln(m) = 2 * atanh((m - 1) / (m + 1))
+    int e;
+    double m = frexp(x, &e);
+    double s = (m - 1) / (m + 1);
+    double s2 = s * s;
+    double sum = 0;
+    for (int k = 21; k >= 1; k -= 2)
+    {
+        sum = sum * s2 + 1.0 / k;
+    }
+    return 2 * s * sum + e * 0.69314718055994530942;
+}
+
+
+// Number of trials before an event of probability p happens (geometric distribution)
+long long random_gap(struct Noise *noise, double p)
+{
+    if (p <= 0.0)
+    {
+        return NO_ERROR;
+    }
+    if (p >= 1.0)
+    {
+        return 0;
+    }
+    // Uniform in (0, 1]
+    double u = ((next_random(noise->rng) >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double gap = ln(u) / ln(1 - p);
+    return gap < NO_ERROR ? (long long) gap : NO_ERROR;
+}
+
+
+// Draw the length of the next good state or burst, in bytes
+long long random_state_length(struct Noise *noise)
+{
+    double mean = noise->inBurst ? noise->burstLength : noise->burstGap;
+    return 1 + random_gap(noise, mean > 1.0 ? 1.0 / mean : 1.0);
+}
+
+
+// Restart the error counters after the model of the line changed
+void reset_noise(struct Noise *noise)
+{
+    noise->inBurst = FALSE;
+    noise->bytesToSwitch = noise->burstLength > 0.0 ? random_state_length(noise) : NO_ERROR;
+    noise->bitsToError = random_gap(noise, noise->ber);
+    noise->bytesToDelete = random_gap(noise, noise->deleteRate);
+    noise->bytesToInsert = random_gap(noise, noise->insertRate);
+}
+
+
+// Seed the generators of both lines, each with its own stream (splitmix64)
+void seed_noise(unsigned long long seed)
+{
+    struct Line *lines[] = {&par.tx2rx, &par.rx2tx};
+    par.seed = seed;
+    for (int i = 0; i < 2; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            unsigned long long z = (seed += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            lines[i]->noise.rng[j] = z ^ (z >> 31);
+        }
+        reset_noise(&lines[i]->noise);
+    }
+}
+
+
+// Apply the channel model to a byte that arrives at time t. Writes to out the bytes
+// that actually arrive (none, the byte with errors, or also a spurious one), and sets
+// the TRACE_ flags telling what happened.
+// Returns the number of bytes written to out.
+int add_noise(struct Noise *noise, char byte, long long t, char *out, int *flags)
+{
+    *flags = 0;
+    if (noise->dropPeriod > 0 && t >= noise->dropStart &&
+        (t - noise->dropStart) % noise->dropPeriod < noise->dropLength)
+    {
+        noise->dropped++;
+        *flags = TRACE_DROPPED;
+        return 0;
+    }
+
+    if (noise->bytesToSwitch-- == 0)
+    {
+        noise->inBurst = !noise->inBurst;
+        noise->bytesToSwitch = random_state_length(noise) - 1;
+        noise->bitsToError = random_gap(noise, noise->inBurst ? noise->burstBer : noise->ber);
+    }
+
+    int size = 0;
+    if (noise->bytesToDelete-- == 0)
+    {
+        noise->bytesToDelete = random_gap(noise, noise->deleteRate);
+        noise->deleted++;
+        *flags = TRACE_DELETED;
+    }
+    else
+    {
+        if (noise->bitsToError < 8)
+        {
+            noise->corrupted++;
+            *flags = TRACE_CORRUPTED;
+        }
+        while (noise->bitsToError < 8)
+        {
+            byte ^= (char) (1 << noise->bitsToError);
+            noise->bitsToError += 1 + random_gap(noise, noise->inBurst ? noise->burstBer : noise->ber);
+            noise->flippedBits++;
+        }
+        noise->bitsToError -= 8;
+        out[size++] = byte;
+    }
+
+    if (noise->bytesToInsert-- == 0)
+    {
+        noise->bytesToInsert = random_gap(noise, noise->insertRate);
+        noise->inserted++;
+        *flags |= TRACE_INSERTED;
+        out[size++] = (char) next_random(noise->rng);
+    }
+    return size;
 }
 
 
-// Add noise to a buffer, by flipping the byte in the "errorIndex" position.
-void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
+// Show the channel model of one line
+void show_noise(const char *name, const struct Noise *noise)
 {
-    buf[errorIndex] ^= 0xFF;
+    printf("%s: BER %g", name, noise->ber);
+    if (noise->burstLength > 0.0)
+    {
+        printf(", BURSTS OF %g BYTES AT BER %g EVERY %g BYTES", noise->burstLength, noise->burstBer,
+               noise->burstGap);
+    }
+    if (noise->deleteRate > 0.0)
+    {
+        printf(", DELETE %g", noise->deleteRate);
+    }
+    if (noise->insertRate > 0.0)
+    {
+        printf(", INSERT %g", noise->insertRate);
+    }
+    if (noise->dropPeriod > 0)
+    {
+        printf(", DROPOUT %lld usec EVERY %lld usec", noise->dropLength / 1000, noise->dropPeriod / 1000);
+    }
+    printf("\n");
 }
 
 
-// Initialize the ring buffers that implement the propagation delay
+// Initialize the ring buffers that implement the propagation delay. The bytes in flight
+// are carried over, still due when they were before the change.
 // Returns 0 on success, -1 on failure
 int init_ring_buffers(void)
 {
-    long nsecPropDelay = 1000 * par.propDelay;
-    long bytesInFlight = nsecPropDelay / par.byteDelay.tv_nsec;
-    // Round instead of truncating
-    if (nsecPropDelay % par.byteDelay.tv_nsec > par.byteDelay.tv_nsec / 2)
+    // Bytes in flight, plus the ones read ahead of the line
+    long size = (1000LL * par.propDelay + READ_AHEAD) / par.byteDelay + 2;
+    struct Line *lines[] = {&par.tx2rx, &par.rx2tx};
+    for (int i = 0; i < 2; i++)
     {
-        ++bytesInFlight;
+        if (lines[i]->count > size)
+        {
+            size = lines[i]->count;
+        }
     }
-    long actualPropDelay = bytesInFlight * par.byteDelay.tv_nsec / 1000; // usec
-    par.bufSize = bytesInFlight + 1;
-    par.tx2rx = realloc(par.tx2rx, par.bufSize);
-    par.tx2rxValid = realloc(par.tx2rxValid, par.bufSize);
-    par.rx2tx = realloc(par.rx2tx, par.bufSize);
-    par.rx2txValid = realloc(par.rx2txValid, par.bufSize);
-    if (par.tx2rx == NULL || par.tx2rxValid == NULL || par.rx2tx == NULL || par.rx2txValid == NULL)
+
+    for (int i = 0; i < 2; i++)
     {
-        return -1;
+        struct Line *line = lines[i];
+        char *data = malloc(size);
+        long long *due = malloc(size * sizeof(long long));
+        if (data == NULL || due == NULL)
+        {
+            free(data);
+            free(due);
+            return -1;
+        }
+        for (long j = 0; j < line->count; j++)
+        {
+            data[j] = line->data[(line->head + j) % par.bufSize];
+            due[j] = line->due[(line->head + j) % par.bufSize];
+        }
+        free(line->data);
+        free(line->due);
+        line->data = data;
+        line->due = due;
+        line->head = 0;
     }
-    bzero(par.tx2rxValid, par.bufSize);
-    bzero(par.rx2txValid, par.bufSize);
-    par.tx2rxIdx = 0;
-    par.rx2txIdx = 0;
-    printf("PROPAGATION DELAY SET TO %ld usec (DESIRED = %lu usec)\n", actualPropDelay, par.propDelay);
+    par.bufSize = size;
+    printf("PROPAGATION DELAY SET TO %lu usec\n", par.propDelay);
     return 0;
 }
 
@@ -124,102 +428,380 @@ int init_ring_buffers(void)
 void set_baud_rate(unsigned long baud)
 {
     // 10 bit times per byte; delay in nanoseconds
-    double delay = 1.0e10 / baud;
-    par.byteDelay.tv_sec = 0;
-    par.byteDelay.tv_nsec = (long) delay;
+    par.byteDelay = 10000000000LL / baud;
+    par.baud = baud;
     printf("BAUD RATE: %lu\n", baud);
     init_ring_buffers();
 }
 
 
-// Make the program use RT priority to improve precision in timing
-void set_rt_priority(void) {
-    struct sched_param sp = { .sched_priority = 50 };
-    if (sched_setscheduler(0, SCHED_FIFO, &sp) == -1) {
-      perror("Could not set realtime priority");
+// Write the buffered records of the trace
+void flush_trace(void)
+{
+    ssize_t size = traced * sizeof(struct TraceRecord);
+    if (traced > 0 && write(par.traceFd, trace, size) != size)
+    {
+        perror("Writing the trace");
     }
+    traced = 0;
 }
 
 
-// Compute the difference between two timespecs
-struct timespec timespec_diff(const struct timespec *t2, const struct timespec *t1)
+void endlog(void)
 {
-    struct timespec diff = { .tv_sec = t2->tv_sec - t1->tv_sec,
-                             .tv_nsec = t2->tv_nsec - t1->tv_nsec };
-    if (diff.tv_nsec < 0) {
-        diff.tv_nsec += 1000000000;
-        --diff.tv_sec;
+    if (par.traceFd >= 0)
+    {
+        flush_trace();
+        close(par.traceFd);
+        par.traceFd = -1;
     }
-    return diff;
 }
 
 
-// Compute the sum of two timespecs
-struct timespec timespec_sum(const struct timespec *t1, const struct timespec *t2)
+void startlog(const char *filename)
 {
-    struct timespec sum = { .tv_sec = t1->tv_sec + t2->tv_sec,
-                             .tv_nsec = t1->tv_nsec + t2->tv_nsec };
-    if (sum.tv_nsec >= 1000000000) {
-        sum.tv_nsec -= 1000000000;
-        ++sum.tv_sec;
+    endlog();
+    struct TraceHeader header = {.magic = TRACE_MAGIC, .version = TRACE_VERSION,
+                                 .recordSize = sizeof(struct TraceRecord)};
+    par.traceFd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (par.traceFd >= 0 && write(par.traceFd, &header, sizeof(header)) == sizeof(header))
+    {
+        par.traceStart = now_nsec();
+        printf("LOGGING TO FILE %s\n", filename);
+    }
+    else
+    {
+        printf("ERROR OPENING FILE %s, NOT LOGGING\n", filename);
+        endlog();
     }
-    return sum;
 }
 
 
-// Compare two timespecs returning -1, 0 or 1 if t1 is less than, equal or
-// greater than t2, respectively
-int timespec_comp(const struct timespec *t1, const struct timespec *t2)
+// Add a record for a byte of the line to the trace, at time t
+void trace_byte(const struct Line *line, long long t, unsigned int index, int flags, char byte, char original)
 {
-    if (t1->tv_sec < t2->tv_sec) {
-        return -1;
+    struct TraceRecord *record = &trace[traced++];
+    record->time = t - par.traceStart;
+    record->index = index;
+    record->direction = line == &par.rx2tx;
+    record->flags = flags;
+    record->byte = byte;
+    record->original = original;
+    if (traced == TRACE_RECORDS)
+    {
+        flush_trace();
     }
-    else if (t1->tv_sec > t2->tv_sec) {
-        return 1;
+}
+
+
+// Trace what became of a byte of the line at time t, given the flags and the bytes
+// that arrived from add_noise
+void trace_delivery(const struct Line *line, long long t, unsigned int index, int flags, char byte,
+                    const char *out, int arrived)
+{
+    if (flags & (TRACE_DELETED | TRACE_DROPPED))
+    {
+        trace_byte(line, t, index, flags & (TRACE_DELETED | TRACE_DROPPED), byte, byte);
     }
-    else if (t1->tv_nsec < t2->tv_nsec) {
-        return -1;
+    else
+    {
+        trace_byte(line, t, index, TRACE_DELIVERED | (flags & TRACE_CORRUPTED), out[0], byte);
     }
-    else if (t1->tv_nsec > t2->tv_nsec) {
-        return 1;
+    if (flags & TRACE_INSERTED)
+    {
+        trace_byte(line, t, index, TRACE_DELIVERED | TRACE_INSERTED, out[arrived - 1], out[arrived - 1]);
     }
-    return 0;
 }
 
 
-int timespec_is_negative(const struct timespec *t)
+// Lose the bytes in flight on the line, when the cable is turned off at time t
+void cut_line(struct Line *line, long long t)
 {
-    if (t->tv_sec < 0 || t->tv_nsec < 0)
+    unsigned int index = *line->received - line->count;
+    for (long i = 0; i < line->count && par.traceFd >= 0; i++)
     {
-        return TRUE;
+        char byte = line->data[(line->head + i) % par.bufSize];
+        trace_byte(line, t, index + i, TRACE_CUT, byte, byte);
     }
-    return FALSE;
+    line->cut += line->count;
+    line->count = 0;
 }
 
 
-void endlog(void)
+// Write the bytes of the line that are due by now to the other end, adding noise.
+// Bytes that do not fit in the serial port are lost, as in a receiver overrun, and
+// counted as dropped.
+void deliver(struct Line *line, long long now)
 {
-    if (par.logfile != NULL)
+    char out[BUF_SIZE];
+    int size = 0;
+    // Where the bytes taken from the ring arrived in out, traced once written
+    struct
+    {
+        long long due;
+        unsigned int index;
+        int flags;
+        char byte;
+        int offset;
+        int arrived;
+    } taken[BUF_SIZE];
+    int count = 0;
+
+    // Room for a spurious byte after each one
+    while (line->count > 0 && line->due[line->head] <= now && size < BUF_SIZE - 1)
+    {
+        taken[count].due = line->due[line->head];
+        taken[count].index = *line->received - line->count;
+        taken[count].byte = line->data[line->head];
+        taken[count].offset = size;
+        taken[count].arrived = add_noise(&line->noise, taken[count].byte, taken[count].due, out + size,
+                                         &taken[count].flags);
+        size += taken[count].arrived;
+        count++;
+        line->head = (line->head + 1) % par.bufSize;
+        line->count--;
+    }
+
+    int written = size > 0 ? write(line->fdOut, out, size) : 0;
+    if (written < 0)
+    {
+        written = 0;
+    }
+    if (written > 0)
     {
-        fclose(par.logfile);
-        par.logfile = NULL;
+        __atomic_add_fetch(line->delivered, written, __ATOMIC_SEQ_CST);
+        par.lastDelivered = now;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        int flags = taken[i].flags;
+        if (taken[i].arrived > 0 && taken[i].offset >= written)
+        {
+            // Overrun: neither the byte nor its spurious follower arrived. Only bytes
+            // that arrived count as inserted, so sent + inserted = delivered + lost.
+            line->noise.dropped++;
+            line->noise.inserted -= (flags & TRACE_INSERTED) != 0;
+            flags = TRACE_DROPPED;
+        }
+        else if (taken[i].offset + taken[i].arrived > written)
+        {
+            // Only the spurious follower was lost
+            line->noise.inserted--;
+            flags &= ~TRACE_INSERTED;
+        }
+        if (par.traceFd >= 0)
+        {
+            trace_delivery(line, taken[i].due, taken[i].index, flags, taken[i].byte, out + taken[i].offset,
+                           taken[i].arrived);
+        }
     }
 }
 
 
-void startlog(const char *filename)
+// Read the bytes the line can start sending by now + READ_AHEAD, one every byteDelay
+// after it is free. While the cable is off they still take the line, but are lost.
+void accept_bytes(struct Line *line, long long now)
 {
-    endlog();
-    par.logfile = fopen(filename, "w");
-    if (par.logfile != NULL)
+    if (line->freeAt < now)
     {
-        fprintf(par.logfile, "Tx->Rx | Rx->Tx\n");
-        printf("LOGGING TO FILE %s\n", filename);
+        line->freeAt = now;
     }
-    else
+
+    long room = par.cableOn ? par.bufSize - line->count : BUF_SIZE;
+    long slots = line->freeAt <= now + READ_AHEAD ? (now + READ_AHEAD - line->freeAt) / par.byteDelay + 1 : 0;
+    long wanted = slots < room ? slots : room;
+    if (wanted > BUF_SIZE)
     {
-        printf("ERROR OPENING FILE %s, NOT LOGGING\n", filename);
+        wanted = BUF_SIZE;
+    }
+
+    char in[BUF_SIZE];
+    int bytesRead = wanted > 0 ? read(line->fdIn, in, wanted) : 0;
+    line->throttled = bytesRead == wanted;
+    if (bytesRead <= 0)
+    {
+        return;
+    }
+    __atomic_add_fetch(line->received, bytesRead, __ATOMIC_SEQ_CST);
+    if (par.startTime == NEVER)
+    {
+        par.startTime = now;
+    }
+
+    unsigned int index = *line->received - bytesRead;
+    for (int i = 0; i < bytesRead; i++)
+    {
+        line->freeAt += par.byteDelay;
+        if (par.traceFd >= 0)
+        {
+            trace_byte(line, line->freeAt - par.byteDelay, index + i, TRACE_SENT, in[i], in[i]);
+        }
+        if (par.cableOn)
+        {
+            long tail = (line->head + line->count) % par.bufSize;
+            line->data[tail] = in[i];
+            line->due[tail] = line->freeAt + 1000LL * par.propDelay;
+            line->count++;
+        }
+        else
+        {
+            if (par.traceFd >= 0)
+            {
+                trace_byte(line, line->freeAt - par.byteDelay, index + i, TRACE_CUT, in[i], in[i]);
+            }
+            line->cut++;
+        }
+    }
+}
+
+
+// Time the line needs servicing next: its next byte is due or it can read more
+long long next_event(const struct Line *line)
+{
+    long long next = line->count > 0 ? line->due[line->head] : NEVER;
+    if (line->throttled && line->count < par.bufSize)
+    {
+        long long readAt = line->freeAt - READ_AHEAD;
+        if (next == NEVER || readAt < next)
+        {
+            next = readAt;
+        }
+    }
+    return next;
+}
+
+
+// Earliest of two event times
+long long earliest(long long time, long long other)
+{
+    return time == NEVER || (other != NEVER && other < time) ? other : time;
+}
+
+
+// Time the next event of the scenario is due, NEVER if none or before the first byte
+long long next_scenario_event(void)
+{
+    if (scenario.next == scenario.count || par.startTime == NEVER)
+    {
+        return NEVER;
+    }
+    return par.startTime + scenario.events[scenario.next].at;
+}
+
+
+// Arm the timer for the earliest event of both lines and the scenario, or disarm it
+// if there is none
+void arm_timer(int timerFd)
+{
+    long long next = earliest(next_event(&par.tx2rx), next_event(&par.rx2tx));
+    next = earliest(next, next_scenario_event());
+
+    struct itimerspec spec = {0};
+    if (next != NEVER)
+    {
+        // A zero time would disarm the timer
+        next = next > 0 ? next : 1;
+        spec.it_value.tv_sec = next / 1000000000LL;
+        spec.it_value.tv_nsec = next % 1000000000LL;
+    }
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+
+// Create the virtual clock file named by LL_VCLOCK, if set
+void open_vclock(void)
+{
+    const char *path = getenv(VCLOCK_ENV);
+    struct VirtualClock *shared = &realTime;
+    if (path != NULL)
+    {
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0 || ftruncate(fd, sizeof(struct VirtualClock)) != 0)
+        {
+            perror(path);
+            exit(-1);
+        }
+        shared = mmap(NULL, sizeof(struct VirtualClock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (shared == MAP_FAILED)
+        {
+            perror("Mapping the virtual shared");
+            exit(-1);
+        }
+        par.vclock = shared;
+        printf("VIRTUAL CLOCK %s\n", path);
     }
+
+    par.tx2rx.received = &shared->port[0].received;
+    par.rx2tx.delivered = &shared->port[0].delivered;
+    par.rx2tx.received = &shared->port[1].received;
+    par.tx2rx.delivered = &shared->port[1].delivered;
+}
+
+
+// In virtual time, whether the end of a port can only act once the clock advances:
+// it waits for data or for its timeout, having read everything delivered, or it is
+// writing bytes the line has no time for yet. Sets wakeAt to the end of its wait, if any.
+int port_idle(int port, const struct Line *from, const struct Line *to, long long *wakeAt)
+{
+    *wakeAt = NEVER;
+    if (!LOAD(par.vclock->port[port].attached))
+    {
+        return TRUE;
+    }
+
+    // Consistent only if no thread of the end started or stopped waiting meanwhile
+    unsigned int changes = LOAD(par.vclock->port[port].changes);
+    int polling = LOAD(par.vclock->port[port].polling);
+    int blocked = LOAD(par.vclock->port[port].blocked);
+    int writing = LOAD(par.vclock->port[port].writing);
+    long long wake = LOAD(par.vclock->port[port].wakeAt);
+    int unsent = LOAD(par.vclock->port[port].written) != LOAD(*from->received);
+    int unread = LOAD(par.vclock->port[port].read) != LOAD(*to->delivered);
+    if (LOAD(par.vclock->port[port].changes) != changes || writing > 0 || polling + blocked == 0 ||
+        (unsent && !from->throttled))
+    {
+        return FALSE;
+    }
+    if (polling == 0)
+    {
+        return unsent;
+    }
+    if (unread)
+    {
+        return FALSE;
+    }
+    *wakeAt = wake;
+    return TRUE;
+}
+
+
+// Move the virtual clock to the next event if neither end can act before it.
+// Returns TRUE if the clock moved.
+int advance_vclock(long long now)
+{
+    long long next = earliest(next_event(&par.tx2rx), next_event(&par.rx2tx));
+    next = earliest(next, next_scenario_event());
+    long long wakeAt;
+
+    if (!port_idle(0, &par.tx2rx, &par.rx2tx, &wakeAt))
+    {
+        return FALSE;
+    }
+    next = earliest(next, wakeAt);
+    if (!port_idle(1, &par.rx2tx, &par.tx2rx, &wakeAt))
+    {
+        return FALSE;
+    }
+    next = earliest(next, wakeAt);
+
+    if (next == NEVER || next <= now)
+    {
+        return FALSE;
+    }
+    STORE(par.vclock->now, next);
+    return TRUE;
 }
 
 
@@ -227,332 +809,625 @@ void startlog(const char *filename)
 void help()
 {
     printf("\n\n"
-           "Transmitter must open " TXDEV "\n"
-           "Receiver must open " RXDEV "\n"
+           "Transmitter must open %s\n"
+           "Receiver must open %s\n"
            "\n"
            "The cable program is sensible to the following interactive commands:\n"
            "--- help         : show this help\n"
            "--- on           : connect the cable and data is exchanged (default state)\n"
            "--- off          : disconnect the cable disabling data to be exchanged\n"
            "--- ber <ber>    : add noise to data bits at a specified BER (default=0)\n"
-           "--- baud <rate>  : set baud rate, between 1200 and 115200 (default=9600)\n"
+           "--- burst <ber> <length> <gap> : add bursts of errors at a higher BER, with\n"
+           "                   a mean length and a mean gap between them in bytes\n"
+           "                   (Gilbert-Elliott model; burst 0 0 0 for none)\n"
+           "--- delete <rate> : lose bytes with the specified probability (default=0)\n"
+           "--- insert <rate> : insert spurious bytes with the specified probability\n"
+           "--- dropout <period> <length> : drop all bytes for length once every period,\n"
+           "                   in usec or with a unit (dropout 0 0 for none)\n"
+           "--- seed <seed>  : restart the noise from the specified seed (default=1)\n"
+           "--- noise        : show the noise settings\n"
+           "                   Noise commands prefixed by tx2rx or rx2tx only apply to\n"
+           "                   that direction, e.g. \"rx2tx ber 1e-4\"\n"
+           "--- baud <rate>  : set baud rate, between 1200 and 921600 (default=9600)\n"
            "                   note that 10 bits are sent per byte (8-N-1)\n"
-           "--- prop <delay> : set the propagation delay in usec (0-1000000, default=0)\n"
-           "                   will be approximated to an integer multiple of the byte\n"
-           "                   delay (10 / baud_rate)\n"
-           "--- log <file>   : log transmitted data to file\n"
+           "--- prop <delay> : set the propagation delay in usec, or with a unit such as\n"
+           "                   200ms (at most 1s, default=0)\n"
+           "--- log <file>   : log transmitted data to a binary trace file, decoded\n"
+           "                   with the trace program (see cable/trace.c)\n"
            "--- endlog       : stop logging transmitted data\n"
            "--- quit         : terminate the program\n"
            "\n"
-           "IMPORTANT: Changing the baud rate or propagation delay while a transmission is\n"
-           "           ongoing will result in losses.\n"
-           "\n");
+           "Changing the baud rate or propagation delay while a transmission is ongoing\n"
+           "keeps the bytes in flight: they arrive when they were due before the change.\n"
+           "\n", par.links[0], par.links[1]);
 }
 
-int main(int argc, char *argv[])
+// Parse a duration such as 2s, 200ms or 500us, in unit nsec if it has no suffix.
+// Returns the number of characters parsed, 0 if text does not start with a duration.
+int parse_duration(const char *text, long long unit, long long *nsec)
 {
-    printf("\n");
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0.0)
+    {
+        return 0;
+    }
+    if (strncmp(end, "ms", 2) == 0 || strncmp(end, "us", 2) == 0)
+    {
+        unit = end[0] == 'm' ? 1000000LL : 1000LL;
+        end += 2;
+    }
+    else if (*end == 's')
+    {
+        unit = 1000000000LL;
+        end++;
+    }
+    *nsec = (long long) (value * unit);
+    return end - text;
+}
 
-    system("socat -dd PTY,link=" TXDEV ",mode=777,raw,echo=0 PTY,link=/dev/emulatorTx,mode=777,raw,echo=0 &");
-    sleep(1);
-    printf("\n");
 
-    system("socat -dd PTY,link=" RXDEV ",mode=777,raw,echo=0 PTY,link=/dev/emulatorRx,mode=777,raw,echo=0 &");
-    sleep(1);
+// Whether a command argument is just a duration
+int is_duration(const char *text, long long unit, long long *nsec)
+{
+    int size = parse_duration(text, unit, nsec);
+    return size > 0 && text[size] == '\0';
+}
 
-    help();
 
-    // Configure serial ports
-    struct termios oldtioTx;
-    struct termios newtioTx;
+// Run a command read from stdin
+// Returns TRUE if the program must terminate
+int run_command(const char *command)
+{
+    // Noise commands apply to the lines from first to last
+    struct Line *lines[] = {&par.tx2rx, &par.rx2tx};
+    int first = 0;
+    int last = 1;
+    if (strncmp(command, "tx2rx ", 6) == 0 || strncmp(command, "rx2tx ", 6) == 0)
+    {
+        first = last = command[0] == 'r';
+        command += 6;
+    }
 
-    int fdTx = openSerialPort("/dev/emulatorTx", &oldtioTx, &newtioTx);
+    double rate = 0;
+    double length = 0;
+    double gap = 0;
+    long long period = 0;
+    long long dropLength = 0;
+    unsigned long long seed;
+    char arguments[2][COMMAND_SIZE];
+
+    if (first == last && strncmp(command, "ber ", 4) != 0 && strncmp(command, "burst ", 6) != 0 &&
+        strncmp(command, "delete ", 7) != 0 && strncmp(command, "insert ", 7) != 0 &&
+        strncmp(command, "dropout ", 8) != 0)
+    {
+        printf("ONLY BER, BURST, DELETE, INSERT AND DROPOUT CAN BE SET PER DIRECTION\n");
+    }
+    else if (strcmp(command, "off") == 0)
+    {
+        printf("CONNECTION OFF\n");
+        par.cableOn = FALSE;
+        // Bytes in flight are lost
+        cut_line(&par.tx2rx, now_nsec());
+        cut_line(&par.rx2tx, now_nsec());
+    }
+    else if (strcmp(command, "on") == 0)
+    {
+        printf("CONNECTION ON\n");
+        par.cableOn = TRUE;
+    }
+    else if (strncmp(command, "ber ", 4) == 0)
+    {
+        if (sscanf(command + 4, "%lf", &rate) == 1 && rate >= 0.0 && rate < 1.0)
+        {
+            printf("BER SET TO %lf\n", rate);
+            for (int i = first; i <= last; i++)
+            {
+                lines[i]->noise.ber = rate;
+                reset_noise(&lines[i]->noise);
+            }
+        }
+        else
+        {
+            printf("BAD BER VALUE %lf (MUST BE 0 <= BER < 1.0)\n", rate);
+        }
+    }
+    else if (strncmp(command, "burst ", 6) == 0)
+    {
+        if (sscanf(command + 6, "%lf %lf %lf", &rate, &length, &gap) == 3 && rate >= 0.0 && rate < 1.0 &&
+            length >= 0.0 && gap >= 0.0)
+        {
+            for (int i = first; i <= last; i++)
+            {
+                lines[i]->noise.burstBer = rate;
+                lines[i]->noise.burstLength = length;
+                lines[i]->noise.burstGap = gap;
+                reset_noise(&lines[i]->noise);
+            }
+            printf(length > 0.0 ? "BURSTS SET\n" : "NO BURSTS\n");
+        }
+        else
+        {
+            printf("BAD BURST PARAMETERS (MUST BE <ber> <length> <gap>, 0 <= BER < 1.0)\n");
+        }
+    }
+    else if (strncmp(command, "delete ", 7) == 0 || strncmp(command, "insert ", 7) == 0)
+    {
+        if (sscanf(command + 7, "%lf", &rate) == 1 && rate >= 0.0 && rate < 1.0)
+        {
+            for (int i = first; i <= last; i++)
+            {
+                *(command[0] == 'd' ? &lines[i]->noise.deleteRate : &lines[i]->noise.insertRate) = rate;
+                reset_noise(&lines[i]->noise);
+            }
+            printf("%s RATE SET TO %lf\n", command[0] == 'd' ? "DELETE" : "INSERT", rate);
+        }
+        else
+        {
+            printf("BAD RATE (MUST BE 0 <= RATE < 1.0)\n");
+        }
+    }
+    else if (strncmp(command, "dropout ", 8) == 0)
+    {
+        if (sscanf(command + 8, "%127s %127s", arguments[0], arguments[1]) == 2 &&
+            is_duration(arguments[0], 1000, &period) && is_duration(arguments[1], 1000, &dropLength))
+        {
+            for (int i = first; i <= last; i++)
+            {
+                lines[i]->noise.dropPeriod = period;
+                lines[i]->noise.dropLength = dropLength;
+                lines[i]->noise.dropStart = now_nsec();
+            }
+            printf(period > 0 ? "DROPOUTS SET\n" : "NO DROPOUTS\n");
+        }
+        else
+        {
+            printf("BAD DROPOUT PARAMETERS (MUST BE <period> <length>)\n");
+        }
+    }
+    else if (strncmp(command, "seed ", 5) == 0)
+    {
+        if (sscanf(command + 5, "%llu", &seed) == 1)
+        {
+            seed_noise(seed);
+            printf("SEED SET TO %llu\n", seed);
+        }
+        else
+        {
+            printf("BAD SEED\n");
+        }
+    }
+    else if (strcmp(command, "noise") == 0)
+    {
+        show_noise("TX->RX", &par.tx2rx.noise);
+        show_noise("RX->TX", &par.rx2tx.noise);
+    }
+    else if (strncmp(command, "baud ", 5) == 0)
+    {
+        unsigned long baud = 0;
+        sscanf(command + 5, "%lu", &baud);
+        switch (baud) {
+            case 1200:
+            case 1800:
+            case 2400:
+            case 4800:
+            case 9600:
+            case 19200:
+            case 38400:
+            case 57600:
+            case 115200:
+            case 230400:
+            case 460800:
+            case 921600:
+                set_baud_rate(baud);
+                break;
+            default:
+                printf("UNSUPPORTED BAUD RATE: must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400, 460800 or 921600\n");
+        }
+    }
+    else if (strncmp(command, "prop ", 5) == 0)
+    {
+        long long propDelay;
+        if (!is_duration(command + 5, 1000, &propDelay) || propDelay > 1000000000LL)
+        {
+            printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
+        }
+        else
+        {
+            par.propDelay = propDelay / 1000;
+            init_ring_buffers();
+        }
+    }
+    else if (strncmp(command, "log ", 4) == 0)
+    {
+        startlog(command + 4);
+    }
+    else if (strcmp(command, "endlog") == 0)
+    {
+        endlog();
+        printf("NOT LOGGING\n");
+    }
+    else if (strcmp(command, "quit") == 0)
+    {
+        printf("END OF THE PROGRAM\n");
+        return TRUE;
+    }
+    else if (strcmp(command, "help") == 0) {
+        help();
+    }
+    else {
+        printf("BAD COMMAND OR MISSING PARAMETERS\n");
+    }
+    return FALSE;
+}
 
-    if (fdTx < 0)
+// Load the events of a scenario file. Each line is "<time> <command>", with the
+// time counted from the first byte either end sends (in seconds without a unit),
+// the command as typed on stdin, and anything after # a comment.
+void load_scenario(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
     {
-        perror("Opening Tx emulator serial port");
+        perror(path);
         exit(-1);
     }
 
-    struct termios oldtioRx;
-    struct termios newtioRx;
+    char text[BUF_SIZE];
+    int lineNumber = 0;
+    while (fgets(text, BUF_SIZE, file) != NULL)
+    {
+        lineNumber++;
+        text[strcspn(text, "#\r\n")] = '\0';
+        char *line = text + strspn(text, " \t");
+        int end = strlen(line);
+        while (end > 0 && (line[end - 1] == ' ' || line[end - 1] == '\t'))
+        {
+            line[--end] = '\0';
+        }
+        if (end == 0)
+        {
+            continue;
+        }
+
+        long long at;
+        int size = parse_duration(line, 1000000000LL, &at);
+        char *command = line + size + strspn(line + size, " \t");
+        if (size == 0 || command == line + size || strlen(command) >= COMMAND_SIZE ||
+            scenario.count == MAX_EVENTS)
+        {
+            printf("%s:%d: BAD EVENT (MUST BE <time> <command>, AT MOST %d)\n", path, lineNumber, MAX_EVENTS);
+            exit(-1);
+        }
 
-    int fdRx = openSerialPort("/dev/emulatorRx", &oldtioRx, &newtioRx);
+        // Keep the events sorted by time, in the order of the file for the same time
+        int i = scenario.count++;
+        while (i > 0 && scenario.events[i - 1].at > at)
+        {
+            scenario.events[i] = scenario.events[i - 1];
+            i--;
+        }
+        scenario.events[i].at = at;
+        strcpy(scenario.events[i].command, command);
+    }
+    fclose(file);
+    printf("SCENARIO %s: %d EVENTS\n", path, scenario.count);
+}
 
-    if (fdRx < 0)
+
+// Run the events of the scenario that are due by now
+// Returns TRUE if the program must terminate
+int run_events(long long now)
+{
+    while (scenario.next < scenario.count)
     {
-        perror("Opening Rx emulator serial port");
+        struct Event *event = &scenario.events[scenario.next];
+        if (event->at > 0 && (par.startTime == NEVER || par.startTime + event->at > now))
+        {
+            break;
+        }
+        scenario.next++;
+        printf("[%.3f s] %s\n", event->at / 1e9, event->command);
+        if (run_command(event->command))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+
+// Create a pseudo terminal for an end, linked from the path it opens
+// Returns the file descriptor of the cable side
+int create_port(const char *link)
+{
+    int fd;
+    int endFd;
+    char name[64];
+    if (openpty(&fd, &endFd, name, NULL, NULL) != 0)
+    {
+        perror("openpty");
         exit(-1);
     }
 
-    // Configure stdin to receive commands to this program
-    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+    // Raw, so the bytes sent before the end opens it are not changed or echoed
+    struct termios tio;
+    tcgetattr(endFd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(endFd, TCSANOW, &tio);
+    close(endFd);
+    chmod(name, 0666);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    // Replace the link of a previous run, but never a real serial port
+    struct stat st;
+    if (lstat(link, &st) == 0 && S_ISLNK(st.st_mode))
+    {
+        unlink(link);
+    }
+    if (symlink(name, link) != 0)
+    {
+        printf("CANNOT LINK %s TO %s: %s\n"
+               "Choose other paths with -t and -r to run without root, e.g. -t /tmp/ttyS10 -r /tmp/ttyS11\n",
+               link, name, strerror(errno));
+        exit(-1);
+    }
+    return fd;
+}
 
-    char rxStdin[BUF_SIZE] = {0};
 
-    int STOP = FALSE;
+// Remove the links to the ports
+void remove_links(void)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        struct stat st;
+        if (lstat(par.links[i], &st) == 0 && S_ISLNK(st.st_mode))
+        {
+            unlink(par.links[i]);
+        }
+    }
+}
 
-    set_baud_rate(DEFAULT_BAUDRATE);
 
-    set_rt_priority();
+// Whether neither end has its port open
+int ports_closed(void)
+{
+    struct pollfd pfd[2] = {{.fd = par.tx2rx.fdIn}, {.fd = par.rx2tx.fdIn}};
+    poll(pfd, 2, 0);
+    return (pfd[0].revents & POLLHUP) && (pfd[1].revents & POLLHUP);
+}
 
-    // For logging
-    char tx2rxTx[3], tx2rxRx[3], rx2txTx[3], rx2txRx[3];
-    int cableIdle = FALSE;
 
-    printf("\nCable ready\n\n");
+// Write the counters of a line as a JSON object
+void write_line_results(FILE *file, const char *name, const struct Line *line)
+{
+    fprintf(file,
+            "  \"%s\": {\"sent\": %llu, \"delivered\": %llu, \"cut\": %llu, \"dropped\": %llu, "
+            "\"deleted\": %llu, \"inserted\": %llu, \"corrupted\": %llu, \"flippedBits\": %llu}",
+            name, *line->received, *line->delivered, line->cut, line->noise.dropped, line->noise.deleted,
+            line->noise.inserted, line->noise.corrupted, line->noise.flippedBits);
+}
 
-    // To compensate for deviations in byte transmission time
-    struct timespec currentTime, nextTxTime, timeDiff, nextWait;
-    int skipWait = FALSE;
-    int unreliableRate = FALSE;
-    clock_gettime(CLOCK_MONOTONIC, &nextTxTime);
 
-    while (STOP == FALSE)
+// Write the results of the run as JSON to path, or to stdout if it is "-"
+void write_results(const char *path)
+{
+    FILE *file = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (file == NULL)
     {
-        // Check how much waiting time we should have (if any)
-        clock_gettime(CLOCK_MONOTONIC, &currentTime);
-        timeDiff = timespec_diff(&currentTime, &nextTxTime);
-        nextTxTime = timespec_sum(&nextTxTime, &par.byteDelay);
-        if (timeDiff.tv_sec >= 1)
-        {
-            if (unreliableRate == FALSE)
-            {
-                printf("UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
-                       "No further warnings will be issued\n");
-                unreliableRate = TRUE;
-            }
-        }
-        nextWait = timespec_diff(&nextTxTime, &currentTime);
-        if (timespec_is_negative(&nextWait))
-        {
-            skipWait = TRUE;
-        }
-        else
-        {
-            skipWait = FALSE;
-        }
+        perror(path);
+        return;
+    }
 
-        // Read from Tx
-        int bytesFromTx = read(fdTx, par.tx2rx + par.tx2rxIdx, 1);
-        par.tx2rxValid[par.tx2rxIdx] = bytesFromTx > 0;
+    double duration = par.startTime == NEVER || par.lastDelivered == NEVER
+                          ? 0.0
+                          : (par.lastDelivered - par.startTime) / 1e9;
+    fprintf(file,
+            "{\n  \"baud\": %lu,\n  \"propDelayUs\": %lu,\n  \"seed\": %llu,\n  \"virtualTime\": %s,\n"
+            "  \"duration\": %.6f,\n",
+            par.baud, par.propDelay, par.seed, par.vclock != NULL ? "true" : "false", duration);
+    write_line_results(file, "tx2rx", &par.tx2rx);
+    fprintf(file, ",\n");
+    write_line_results(file, "rx2tx", &par.rx2tx);
+    fprintf(file, "\n}\n");
+
+    if (file != stdout)
+    {
+        fclose(file);
+    }
+}
 
-        // Read from Rx
-        int bytesFromRx = read(fdRx, par.rx2tx + par.rx2txIdx, 1);
-        par.rx2txValid[par.rx2txIdx] = bytesFromRx > 0;
 
-        if (!par.cableOn)
-        {
-            // Ignore what was read
-            par.tx2rxValid[par.tx2rxIdx] = 0;
-            par.rx2txValid[par.rx2txIdx] = 0;
-        }
+// Show the command line options
+void usage(const char *program)
+{
+    printf("Usage: %s [-s <scenario>] [-o <results>] [-t <tx port>] [-r <rx port>]\n"
+           "  -s: run headless, taking the commands from a scenario file instead of stdin,\n"
+           "      until both ends close their ports\n"
+           "  -o: write the results of the run as JSON to a file (- for stdout, the default\n"
+           "      with -s)\n"
+           "  -t, -r: paths of the transmitter and receiver ports (default " TXDEV " and " RXDEV ")\n",
+           program);
+}
 
-        if (par.logfile != NULL)  // Currently logging
+int main(int argc, char *argv[])
+{
+    const char *scenarioPath = NULL;
+    const char *resultsPath = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "s:o:t:r:")) != -1)
+    {
+        switch (option)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                sprintf(tx2rxTx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
-            }
-            else
-            {
-                memcpy(tx2rxTx, "  ", 3);
-            }
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                sprintf(rx2txTx, "%02hhX", par.rx2tx[par.rx2txIdx]);
-            }
-            else
-            {
-                memcpy(rx2txTx, "  ", 3);
-            }
+            case 's':
+                scenarioPath = optarg;
+                break;
+            case 'o':
+                resultsPath = optarg;
+                break;
+            case 't':
+                par.links[0] = optarg;
+                break;
+            case 'r':
+                par.links[1] = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                exit(-1);
         }
+    }
+    if (scenarioPath != NULL && resultsPath == NULL)
+    {
+        resultsPath = "-";
+    }
 
-        // Advance indices to next position
-        par.tx2rxIdx = (par.tx2rxIdx + 1) % par.bufSize;
-        par.rx2txIdx = (par.rx2txIdx + 1) % par.bufSize;
+    printf("\n");
 
-        if (par.cableOn)
-        {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.tx2rx[par.tx2rxIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdRx, par.tx2rx + par.tx2rxIdx, 1);
-            }
+    int fdTx = create_port(par.links[0]);
+    int fdRx = create_port(par.links[1]);
 
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.rx2tx[par.rx2txIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdTx, par.rx2tx + par.rx2txIdx, 1);
-            }
-        }
+    par.tx2rx.fdIn = par.rx2tx.fdOut = fdTx;
+    par.rx2tx.fdIn = par.tx2rx.fdOut = fdRx;
+    open_vclock();
 
-        if (par.logfile != NULL)  // Currently logging
-        {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                sprintf(tx2rxRx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
-            }
-            else
-            {
-                memcpy(tx2rxRx, "  ", 3);
-            }
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                sprintf(rx2txRx, "%02hhX", par.rx2tx[par.rx2txIdx]);
-            }
-            else
-            {
-                memcpy(rx2txRx, "  ", 3);
-            }
+    // The relay sleeps in epoll until a serial port or stdin has data, or the timer
+    // expires for the next byte due at the other end. In virtual time the timer ticks
+    // to check whether the clock can move.
+    int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    int epollFd = epoll_create1(0);
+    if (timerFd < 0 || epollFd < 0)
+    {
+        perror("Creating the event loop");
+        exit(-1);
+    }
 
-            if (*tx2rxTx == ' ' && *rx2txTx == ' ' && *tx2rxRx == ' ' && *rx2txRx == ' ')
-            {
-                if (cableIdle == FALSE)
-                {
-                    fputs("---------------\n", par.logfile);
-                    cableIdle = TRUE;
-                }
-            }
-            else
-            {
-                fprintf(par.logfile, "%s  %s | %s  %s\n", tx2rxTx, tx2rxRx, rx2txTx, rx2txRx);
-                cableIdle = FALSE;
-            }
-        }
+    struct epoll_event event = {.events = EPOLLIN | EPOLLET};
+    event.data.fd = fdTx;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, fdTx, &event);
+    event.data.fd = fdRx;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, fdRx, &event);
+    event.events = EPOLLIN;
+    event.data.fd = timerFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &event);
+    if (scenarioPath == NULL)
+    {
+        event.data.fd = STDIN_FILENO;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, STDIN_FILENO, &event);
+    }
+
+    char rxStdin[BUF_SIZE] = {0};
+    int stdinSize = 0;
+
+    int STOP = FALSE;
+
+    seed_noise(DEFAULT_SEED);
+    set_baud_rate(DEFAULT_BAUDRATE);
+
+    if (scenarioPath != NULL)
+    {
+        printf("\nTransmitter must open %s\nReceiver must open %s\n", par.links[0], par.links[1]);
+        load_scenario(scenarioPath);
+        STOP = run_events(now_nsec());
+    }
+    else
+    {
+        help();
+    }
 
-        // Read commands from STDIN to control the cable mode
-        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
-        if (fromStdin > 0)
+    if (par.vclock != NULL)
+    {
+        struct itimerspec tick = {.it_interval.tv_nsec = VCLOCK_TICK, .it_value.tv_nsec = VCLOCK_TICK};
+        timerfd_settime(timerFd, 0, &tick, NULL);
+    }
+
+    printf("\nCable ready\n\n");
+    fflush(stdout);
+
+    int advanced = FALSE;
+    while (STOP == FALSE)
+    {
+        struct epoll_event events[4];
+        int ready = epoll_wait(epollFd, events, 4, advanced ? 0 : -1);
+        if (ready < 0 && errno != EINTR)
         {
-            rxStdin[fromStdin - 1] = '\0';
+            perror("epoll_wait");
+            break;
+        }
 
-            if (strcmp(rxStdin, "off") == 0)
-            {
-                printf("CONNECTION OFF\n");
-                if (par.cableOn && par.logfile != NULL)
-                {
-                    fputs("CABLE OFF\n", par.logfile);
-                }
-                par.cableOn = FALSE;
-            }
-            else if (strcmp(rxStdin, "on") == 0)
+        int hangup = FALSE;
+        for (int i = 0; i < ready; i++)
+        {
+            if (events[i].data.fd == timerFd)
             {
-                printf("CONNECTION ON\n");
-                par.cableOn = TRUE;
+                unsigned long long expirations;
+                read(timerFd, &expirations, sizeof(expirations));
             }
-            else if (strncmp(rxStdin, "ber ", 4) == 0)
+            else if (events[i].data.fd == STDIN_FILENO)
             {
-                double ber;
-                sscanf(rxStdin + 4, "%lf", &ber);
-                // Compute pow(1 - ber, 8) without libm
-                double acc = 1 - ber;
-                acc *= acc;   // Squared
-                acc *= acc;   // To the fourth
-                acc *= acc;   // To the eightth
-                par.byteER = 1.0 - acc;
-                //printf("Byte Error Rate is %lf\n", par.byteER);
-                if (ber >= 0.0 && ber < 1.0)
-                {
-                    printf("BER SET TO %lf\n", ber);
-                    if (ber > 0.01)
-                    {
-                        printf("   ACTUAL BER WILL BE LOWER THAN DEFINED FOR VALUES ABOVE 0.01\n");
-                    }
-                }
-                else
+                // Read commands from STDIN to control the cable mode, one per line
+                int fromStdin = read(STDIN_FILENO, rxStdin + stdinSize, BUF_SIZE - 1 - stdinSize);
+                if (fromStdin <= 0)
                 {
-                    printf("BAD BER VALUE %lf (MUST BE 0 <= BER < 1.0)", ber);
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                    continue;
                 }
-            }
-            else if (strncmp(rxStdin, "baud ", 5) == 0)
-            {
-                unsigned long baud = 0;
-                sscanf(rxStdin + 5, "%lu", &baud);
-                switch (baud) {
-                    case 1200:
-                    case 1800:
-                    case 2400:
-                    case 4800:
-                    case 9600:
-                    case 19200:
-                    case 38400:
-                    case 57600:
-                    case 115200:
-                        set_baud_rate(baud);
-                        break;
-                    default:
-                        printf("UNSUPPORTED BAUD RATE: must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600 or 115200\n");
-                }
-            }
-            else if (strncmp(rxStdin, "prop ", 5) == 0)
-            {
-                unsigned long propDelay;
-                if (sscanf(rxStdin + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
+                stdinSize += fromStdin;
+
+                char *end;
+                while (STOP == FALSE && (end = memchr(rxStdin, '\n', stdinSize)) != NULL)
                 {
-                    printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
+                    *end = '\0';
+                    STOP = run_command(rxStdin);
+                    stdinSize -= end + 1 - rxStdin;
+                    memmove(rxStdin, end + 1, stdinSize);
                 }
-                else
+                if (stdinSize == BUF_SIZE - 1)
                 {
-                    par.propDelay = propDelay;
-                    init_ring_buffers();
+                    stdinSize = 0;
                 }
+                fflush(stdout);
             }
-            else if (strncmp(rxStdin, "log ", 4) == 0)
-            {
-                startlog(rxStdin + 4);
-            }
-            else if (strcmp(rxStdin, "endlog") == 0)
+            else if (events[i].events & EPOLLHUP)
             {
-                endlog();
-                printf("NOT LOGGING\n");
-            }
-            else if (strcmp(rxStdin, "quit") == 0)
-            {
-                printf("END OF THE PROGRAM\n");
-                STOP = TRUE;
-            }
-            else if (strcmp(rxStdin, "help") == 0) {
-                help();
-            }
-            else {
-                printf("BAD COMMAND OR MISSING PARAMETERS\n");
+                // An end closed its port
+                hangup = TRUE;
             }
         }
 
-        if (skipWait == FALSE) {
-            nanosleep(&nextWait, NULL);
+        // Relay whatever is due in both directions, whichever event woke us up
+        long long now = now_nsec();
+        deliver(&par.tx2rx, now);
+        deliver(&par.rx2tx, now);
+        accept_bytes(&par.tx2rx, now);
+        accept_bytes(&par.rx2tx, now);
+
+        if (scenarioPath != NULL && STOP == FALSE)
+        {
+            // A headless run ends once both ends are done
+            STOP = run_events(now) || (hangup && par.startTime != NEVER && ports_closed());
+            fflush(stdout);
         }
-    }
 
-    // Restore the old port settings
-    if (tcsetattr(fdRx, TCSANOW, &oldtioRx) == -1)
-    {
-        perror("tcsetattr");
-        exit(-1);
+        if (par.vclock != NULL)
+        {
+            advanced = advance_vclock(now);
+        }
+        else
+        {
+            arm_timer(timerFd);
+        }
     }
 
-    if (tcsetattr(fdTx, TCSANOW, &oldtioTx) == -1)
+    if (resultsPath != NULL)
     {
-        perror("tcsetattr");
-        exit(-1);
+        write_results(resultsPath);
     }
 
+    endlog();
     close(fdTx);
     close(fdRx);
-
-    system("killall socat");
+    remove_links();
 
     return 0;
 }
@@ -0,0 +1,311 @@
+// Decoder of the binary traces of the virtual cable ("log <file>" command).
+// Reconstructs the frames each end received, destuffed, with their latency: from the
+// time the opening flag entered the cable to the time the closing flag left it.
+//
+// Build: gcc -Wall -o bin/trace cable/trace.c
+// Usage: ./bin/trace [-b] <trace file>
+//   -b: also list every byte
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FALSE 0
+#define TRUE 1
+
+#define FLAG 0x7E
+#define ESCAPE 0x7D
+#define STUFFING 0x20  // Escaped bytes are XORed with this
+
+#define BUF_RECORDS 4096
+
+// Layout of the trace, as written by cable/cable.c
+#define TRACE_MAGIC "CBLTRACE"
+#define TRACE_VERSION 1
+
+#define TRACE_SENT 0x01
+#define TRACE_DELIVERED 0x02
+#define TRACE_CORRUPTED 0x04
+#define TRACE_INSERTED 0x08
+#define TRACE_DELETED 0x10
+#define TRACE_DROPPED 0x20
+#define TRACE_CUT 0x40
+
+#define TRACE_LOST (TRACE_DELETED | TRACE_DROPPED | TRACE_CUT)
+
+struct TraceHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int recordSize;
+};
+
+struct TraceRecord {
+    long long time;
+    unsigned int index;
+    unsigned char direction;
+    unsigned char flags;
+    unsigned char byte;
+    unsigned char original;
+};
+
+// Frames being received in one direction
+struct Direction {
+    const char *name;
+    long long *sentAt;      // Time each byte entered the cable by index, -1 if unknown
+    unsigned int sentSize;  // Bytes in sentAt
+    int open;               // A flag was received and the frame has not ended
+    int escaped;            // The last byte received was an escape
+    unsigned int start;     // Index of the opening flag
+    int size;               // Destuffed size of the frame so far
+    unsigned char header[2];  // Address and control fields
+    int corrupted;          // Bytes of the frame that were corrupted,
+    int inserted;           // inserted,
+    int lost;               // or lost
+    long frames;
+    long damaged;           // Frames with any of the above
+    long timed;             // Frames whose opening flag was traced entering the cable
+    long long totalLatency;
+    long long maxLatency;
+};
+
+struct Direction directions[2] = {{.name = "Tx->Rx"}, {.name = "Rx->Tx"}};
+
+
+// Name of a frame from its control field
+void frame_name(unsigned char control, char *name)
+{
+    static const char *windowed[16] = {[0x0] = "I", [0x1] = "RR", [0x5] = "REJ", [0x9] = "SREJ"};
+    switch (control)
+    {
+        case 0x03: strcpy(name, "SET"); return;
+        case 0x07: strcpy(name, "UA"); return;
+        case 0x0B: strcpy(name, "DISC"); return;
+        case 0xAA: strcpy(name, "RR 0"); return;
+        case 0xAB: strcpy(name, "RR 1"); return;
+        case 0x54: strcpy(name, "REJ 0"); return;
+        case 0x55: strcpy(name, "REJ 1"); return;
+    }
+    if (windowed[control & 0x0F] != NULL)
+    {
+        sprintf(name, "%s %d", windowed[control & 0x0F], control >> 4);
+    }
+    else
+    {
+        sprintf(name, "? %02X", control);
+    }
+}
+
+
+// Print the frame that ended with the flag delivered at time t
+void end_frame(struct Direction *direction, long long t)
+{
+    char name[16] = "?";
+    if (direction->size >= 2)
+    {
+        frame_name(direction->header[1], name);
+    }
+
+    printf("%12.6f  %s     %-8s %6d", t / 1e9, direction->name, name, direction->size);
+    if (direction->start < direction->sentSize && direction->sentAt[direction->start] >= 0)
+    {
+        long long latency = t - direction->sentAt[direction->start];
+        direction->totalLatency += latency;
+        direction->timed++;
+        if (latency > direction->maxLatency)
+        {
+            direction->maxLatency = latency;
+        }
+        printf("  %12.3f", latency / 1e6);
+    }
+    else
+    {
+        printf("  %12s", "-");
+    }
+    if (direction->corrupted + direction->inserted + direction->lost > 0)
+    {
+        printf("  %d corrupted, %d inserted, %d lost", direction->corrupted, direction->inserted,
+               direction->lost);
+        direction->damaged++;
+    }
+    printf("\n");
+    direction->frames++;
+}
+
+
+// Start a frame at the flag with the given index
+void start_frame(struct Direction *direction, unsigned int index)
+{
+    direction->open = TRUE;
+    direction->escaped = FALSE;
+    direction->start = index;
+    direction->size = 0;
+    direction->corrupted = 0;
+    direction->inserted = 0;
+    direction->lost = 0;
+}
+
+
+// Remember when a byte entered the cable
+void byte_sent(struct Direction *direction, const struct TraceRecord *record)
+{
+    if (record->index >= direction->sentSize)
+    {
+        unsigned int size = direction->sentSize > 0 ? direction->sentSize : 4096;
+        while (size <= record->index)
+        {
+            size *= 2;
+        }
+        direction->sentAt = realloc(direction->sentAt, size * sizeof(long long));
+        if (direction->sentAt == NULL)
+        {
+            perror("realloc");
+            exit(-1);
+        }
+        memset(direction->sentAt + direction->sentSize, 0xFF, (size - direction->sentSize) * sizeof(long long));
+        direction->sentSize = size;
+    }
+    direction->sentAt[record->index] = record->time;
+}
+
+
+// Add a byte that left the cable to the frame being received
+void byte_delivered(struct Direction *direction, const struct TraceRecord *record)
+{
+    if (record->byte == FLAG)
+    {
+        if (direction->open && direction->size > 0)
+        {
+            end_frame(direction, record->time);
+        }
+        // Consecutive flags only delimit the next frame
+        start_frame(direction, record->index);
+        return;
+    }
+    if (!direction->open)
+    {
+        return;
+    }
+
+    direction->corrupted += (record->flags & TRACE_CORRUPTED) != 0;
+    direction->inserted += (record->flags & TRACE_INSERTED) != 0;
+    unsigned char byte = record->byte;
+    if (direction->escaped)
+    {
+        direction->escaped = FALSE;
+        byte ^= STUFFING;
+    }
+    else if (byte == ESCAPE)
+    {
+        direction->escaped = TRUE;
+        return;
+    }
+    if (direction->size < 2)
+    {
+        direction->header[direction->size] = byte;
+    }
+    direction->size++;
+}
+
+
+// Print a record, with -b
+void print_record(const struct TraceRecord *record)
+{
+    const char *what = record->flags & TRACE_SENT        ? "sent"
+                       : record->flags & TRACE_INSERTED  ? "inserted"
+                       : record->flags & TRACE_CORRUPTED ? "corrupted"
+                       : record->flags & TRACE_DELIVERED ? "delivered"
+                       : record->flags & TRACE_DELETED   ? "deleted"
+                       : record->flags & TRACE_DROPPED   ? "dropped"
+                                                         : "cut";
+    printf("%12.6f  %s  %-9s %10u  %02X", record->time / 1e9, directions[record->direction & 1].name, what,
+           record->index, record->byte);
+    if (record->flags & TRACE_CORRUPTED)
+    {
+        printf(" (sent %02X)", record->original);
+    }
+    printf("\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+    int bytes = FALSE;
+    int option;
+    while ((option = getopt(argc, argv, "b")) != -1)
+    {
+        if (option != 'b')
+        {
+            printf("Usage: %s [-b] <trace file>\n", argv[0]);
+            exit(-1);
+        }
+        bytes = TRUE;
+    }
+    if (optind != argc - 1)
+    {
+        printf("Usage: %s [-b] <trace file>\n", argv[0]);
+        exit(-1);
+    }
+
+    FILE *file = fopen(argv[optind], "rb");
+    if (file == NULL)
+    {
+        perror(argv[optind]);
+        exit(-1);
+    }
+
+    struct TraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, 8) != 0 ||
+        header.version != TRACE_VERSION || header.recordSize != sizeof(struct TraceRecord))
+    {
+        printf("%s is not a cable trace\n", argv[optind]);
+        exit(-1);
+    }
+
+    printf("   Delivered  Direction  Frame      Size  Latency (ms)\n");
+
+    struct TraceRecord records[BUF_RECORDS];
+    size_t count;
+    while ((count = fread(records, sizeof(struct TraceRecord), BUF_RECORDS, file)) > 0)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            const struct TraceRecord *record = &records[i];
+            struct Direction *direction = &directions[record->direction & 1];
+            if (bytes)
+            {
+                print_record(record);
+            }
+
+            if (record->flags & TRACE_SENT)
+            {
+                byte_sent(direction, record);
+            }
+            else if (record->flags & TRACE_DELIVERED)
+            {
+                byte_delivered(direction, record);
+            }
+            else if (record->flags & TRACE_LOST)
+            {
+                direction->lost += direction->open;
+            }
+        }
+    }
+    fclose(file);
+
+    printf("\n");
+    for (int i = 0; i < 2; i++)
+    {
+        struct Direction *direction = &directions[i];
+        printf("%s: %ld frames, %ld damaged", direction->name, direction->frames, direction->damaged);
+        if (direction->timed > 0)
+        {
+            printf(", latency %.3f ms mean, %.3f ms max", direction->totalLatency / 1e6 / direction->timed,
+                   direction->maxLatency / 1e6);
+        }
+        printf("\n");
+        free(direction->sentAt);
+    }
+
+    return 0;
+}
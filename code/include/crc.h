@@ -0,0 +1,23 @@
+// CRC header.
+// Frame check sequences computed with slicing-by-8 tables.
+
+#ifndef _CRC_H_
+#define _CRC_H_
+
+#include <stdint.h>
+
+// CRC-16/X-25 (HDLC FCS): reflected polynomial 0x1021, init and final XOR 0xFFFF.
+#define CRC16_INIT 0xFFFF
+// CRC-32 (IEEE 802.3): reflected polynomial 0x04C11DB7, init and final XOR 0xFFFFFFFF.
+#define CRC32_INIT 0xFFFFFFFF
+
+// Continue a CRC over size bytes of data. Start with CRC16_INIT / CRC32_INIT and
+// apply the final XOR (~) to the result.
+uint16_t crc16Update(uint16_t crc, const unsigned char *data, int size);
+uint32_t crc32Update(uint32_t crc, const unsigned char *data, int size);
+
+// Complete CRC of size bytes of data.
+uint16_t crc16(const unsigned char *data, int size);
+uint32_t crc32(const unsigned char *data, int size);
+
+#endif // _CRC_H_
@@ -0,0 +1,47 @@
+// Frame size estimator header.
+// Chooses the payload of data packets from the frame error rate observed by the transmitter.
+
+#ifndef _FRAMESIZE_H_
+#define _FRAMESIZE_H_
+
+// Smallest payload suggested, in bytes.
+#define SIZER_MIN_PAYLOAD 64
+// Observations are halved once this many bytes were sent, so old ones fade out.
+#define SIZER_MEMORY_BYTES (128.0 * 1024)
+// Clean frames of the current payload needed before suggesting a larger one.
+#define SIZER_GROWTH_FRAMES 4
+
+typedef struct
+{
+    double bytes;      // Frame bytes sent (decayed)
+    double errors;     // Frames rejected or timed out (decayed)
+    double cleanBytes; // Frame bytes sent since the last error or growth
+    int maxPayload;    // Negotiated payload limit
+    int payload;       // Current suggestion
+    int smallest;      // Smallest payload used
+    int largest;       // Largest payload used
+    unsigned int changes; // Times the payload changed
+    unsigned int frames;  // Data packets built
+    long long payloadBytes; // Sum of the payloads used
+    int lastPayload;   // Payload of the last data packet
+} FrameSizer;
+
+// Start with no observations. Suggestions start at initialPayload and grow slowly
+// while no errors are seen, like a slow start, since frames already queued in the
+// window cannot be resized when errors show up.
+void sizerInit(FrameSizer *sizer, int initialPayload, int maxPayload);
+
+// Account for a frame of frameBytes sent (or resent) through the serial port.
+void sizerSent(FrameSizer *sizer, int frameBytes);
+
+// Account for a frame rejected or timed out.
+void sizerError(FrameSizer *sizer);
+
+// Payload maximizing the expected throughput, given the bytes each frame costs on
+// top of its payload (framing, check, acknowledgement and idle line time).
+int sizerSuggest(FrameSizer *sizer, double overheadBytes);
+
+// Account for a data packet built with the given payload, for the statistics.
+void sizerRecord(FrameSizer *sizer, int payload);
+
+#endif // _FRAMESIZE_H_
@@ -0,0 +1,37 @@
+// Checkpoint journal header.
+// Records how much of a file was received and flushed, so the transfer can resume.
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdint.h>
+
+// Appended to the name of the output file.
+#define JOURNAL_SUFFIX ".journal"
+
+typedef struct
+{
+    int fd;             // Open journal, -1 if not open
+    char path[4096];
+    uint64_t fileSize;  // Size of the file being received
+    int64_t fileTime;   // Modification time of the file at the transmitter
+    uint64_t received;  // Bytes from the start of the file already on disk
+} Journal;
+
+// Read the journal of the output file filename.
+// Returns 0 if a valid journal was found, -1 otherwise.
+int journalLoad(Journal *journal, const char *filename);
+
+// Create (or reuse) the journal of the output file filename for a file of the given
+// size and time, recording received bytes as already on disk.
+// Returns 0 on success, -1 on error.
+int journalOpen(Journal *journal, const char *filename, uint64_t fileSize, int64_t fileTime, uint64_t received);
+
+// Record that the first received bytes of the file are on disk.
+// Returns 0 on success, -1 on error.
+int journalUpdate(Journal *journal, uint64_t received);
+
+// Close and delete the journal once the file is complete.
+void journalRemove(Journal *journal);
+
+#endif // _JOURNAL_H_
@@ -0,0 +1,171 @@
+// Link layer extensions header.
+// Optional features negotiated on top of the fixed link_layer.h interface.
+
+#ifndef _LINK_LAYER_EXT_H_
+#define _LINK_LAYER_EXT_H_
+
+#include <sys/uio.h>
+
+typedef enum
+{
+    ArqGoBackN,
+    ArqSelectiveRepeat,
+} ArqMode;
+
+// Check appended to the information field of I frames
+typedef enum
+{
+    FrameCheckBcc2,  // 1 byte XOR of the data
+    FrameCheckCrc16, // 2 byte CRC-16/X-25 (HDLC FCS)
+    FrameCheckCrc32, // 4 byte CRC-32
+} FrameCheck;
+
+// Forward error correction of I frames
+typedef enum
+{
+    FecNone,
+    FecReedSolomon, // RS(255,223) codewords interleaved across the frame
+} FecMode;
+
+typedef struct
+{
+    int windowSize;   // Maximum number of unacknowledged I frames (1 = stop-and-wait)
+    ArqMode arqMode;  // Retransmission strategy used when windowSize > 1
+    FrameCheck frameCheck; // Error detection of I frames
+    int maxPayload;   // Largest application payload carried by an I frame
+    FecMode fec;      // Correction of errors in I frames without retransmitting them
+    int duplex;       // TRUE to let both ends send I frames, acknowledgements riding on them
+    int channels;     // Number of logical channels multiplexed over the link (1 = none)
+} LinkLayerOptions;
+
+// Windowed mode uses 4-bit sequence numbers.
+#define LL_SEQ_MODULUS 16
+#define LL_MAX_WINDOW_GBN (LL_SEQ_MODULUS - 1)
+#define LL_MAX_WINDOW_SR (LL_SEQ_MODULUS / 2)
+
+// Largest negotiable payload, bounded by the 16-bit length of data packets.
+#define LL_MAX_PAYLOAD_SIZE 65535
+// Room left in I frames for the application packet header, on top of the payload.
+// After llsetoptions, llread returns up to maxPayload + LL_PACKET_HEADER_SIZE bytes and
+// its buffer must hold that many; otherwise it keeps to MAX_PAYLOAD_SIZE bytes, dropping
+// the rest. llreadv and llreadch take the size of their buffers.
+#define LL_PACKET_HEADER_SIZE 16
+
+// Logical channels are numbered from 0; llwrite and llread use LL_DEFAULT_CHANNEL.
+#define LL_MAX_CHANNELS 16
+#define LL_DEFAULT_CHANNEL 0
+
+// Largest application data exchanged in llopen.
+#define LL_MAX_OPEN_DATA 64
+
+// Defaults proposed in llopen when llsetoptions is not called. The payload stays at
+// MAX_PAYLOAD_SIZE (link_layer.h), which llread buffers are sized by; larger payloads
+// are opt-in through llsetoptions.
+#define LL_DEFAULT_WINDOW 4
+#define LL_DEFAULT_ARQ ArqGoBackN
+#define LL_DEFAULT_FRAME_CHECK FrameCheckCrc32
+#define LL_DEFAULT_PAYLOAD 1000
+#define LL_DEFAULT_FEC FecNone
+#define LL_DEFAULT_DUPLEX 0
+#define LL_DEFAULT_CHANNELS 1
+
+// Set the options used in the next llopen. The transmitter proposes them in
+// the SET frame and the receiver treats them as upper limits; both adopt the
+// values the receiver echoes in the UA frame. The frame check is the exception:
+// the receiver picks the stronger of both proposals. Forward error correction is
+// used if the transmitter proposes it, full duplex if both ends do. Peers that do
+// not negotiate fall back to stop-and-wait with MAX_PAYLOAD_SIZE payloads.
+void llsetoptions(const LinkLayerOptions *options);
+
+// Print a line for every frame sent, acknowledged or timed out (off by default).
+void llsetverbose(int enabled);
+
+// Set application data sent to the peer in the next llopen: the transmitter sends it
+// in the SET frame and the receiver in the UA frame. At most LL_MAX_OPEN_DATA bytes.
+void llsetopendata(const unsigned char *data, int size);
+
+// Get the application data the peer sent in the last llopen into data, which must
+// hold LL_MAX_OPEN_DATA bytes.
+// Return its size, 0 if the peer sent none.
+int llgetopendata(unsigned char *data);
+
+// In full duplex both ends may call llwrite and llread, also from two threads at once:
+// the link is serviced by whichever call is blocked.
+
+// Get the options agreed in the last llopen.
+void llgetoptions(LinkLayerOptions *options);
+
+// Payload of the next data packet expected to give the best throughput, adapted to
+// the rejections and timeouts seen by llwrite and bounded by the negotiated maximum.
+int llsuggestpayload();
+
+// Account for a data packet sent with payload bytes of data, for the payload
+// statistics llclose prints.
+void llrecordpayload(int payload);
+
+// Like llwrite, but gathers the data from the iovcnt buffers of iov, so a packet
+// header and its data do not need to be copied together first.
+// Return number of chars written, or "-1" on error.
+int llwritev(const struct iovec *iov, int iovcnt);
+
+// Like llread, but scatters the packet over the iovcnt buffers of iov, so its header
+// and its data can be received in different places. Bytes that do not fit are dropped.
+// Return the size of the packet, or "-1" on error.
+int llreadv(const struct iovec *iov, int iovcnt);
+
+// Logical channels share the window: each I frame names its channel, and llreadch
+// returns the frames of one channel in order, leaving the others to their readers.
+// Frames of a channel nobody reads hold the window until they are read.
+
+// Set the priority of channel (higher is more urgent, 0 by default). When the
+// window is full, writers of the most urgent channel waiting are sent first, so
+// short messages do not queue behind a stream of full frames.
+void llsetpriority(int channel, int priority);
+
+// Like llwritev, on the given logical channel.
+// Return number of chars written, or "-1" on error.
+int llwritech(int channel, const struct iovec *iov, int iovcnt);
+
+// Like llreadv, the next packet of the given logical channel. While the receiver window
+// is full of frames of other channels, waits for another thread to read them.
+// Return the size of the packet, or "-1" on error, such as a channel beyond the ones
+// negotiated; errno is EAGAIN if no other thread reads those channels (read them, or
+// llpoll if they have a callback, and retry).
+int llreadch(int channel, const struct iovec *iov, int iovcnt);
+
+// Asynchronous API, to overlap producing and consuming packets in one thread: writes
+// are submitted without waiting for their acknowledgement, and llpoll runs the link
+// (the serial port and the retransmission timers), reporting what completed through
+// callbacks. The callbacks run inside llpoll without the link locked, so they may
+// submit writes. It can be mixed with the blocking calls on other channels.
+
+// Called when the frame of an asynchronous write is acknowledged, with its size as
+// llwrite returns it, or with -1 if the link failed first.
+typedef void (*LlWriteCallback)(void *context, int result);
+
+// Called with each packet received on a channel that has a read callback.
+// packet is only valid during the call.
+typedef void (*LlReadCallback)(void *context, int channel, const unsigned char *packet, int size);
+
+// Send a packet on channel without waiting for its acknowledgement; the buffers are
+// copied before returning. done (may be NULL) is called by llpoll once the peer
+// acknowledges it.
+// Return the size of the frame, 0 if the window is full (call llpoll and retry),
+// or "-1" on error.
+int llwriteasync(int channel, const struct iovec *iov, int iovcnt, LlWriteCallback done, void *context);
+
+// Hand the packets received on channel to callback from llpoll instead of keeping them
+// for llreadch. NULL restores llreadch.
+void llsetreadcallback(int channel, LlReadCallback callback, void *context);
+
+// Run the link for up to timeoutMs milliseconds (0 only handles what is ready, -1 waits
+// for the next frame or timer), then call the callbacks of the completed writes and of
+// the packets received.
+// Return the number of callbacks called, or "-1" if the link failed.
+int llpoll(int timeoutMs);
+
+// Return the number of asynchronous writes whose callback was not called yet; awaiting
+// them all is polling until it is 0.
+int llpending();
+
+#endif // _LINK_LAYER_EXT_H_
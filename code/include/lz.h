@@ -0,0 +1,15 @@
+// Block compression header.
+// LZ77 codec in the LZ4 block format: fast enough to keep up with any serial line.
+
+#ifndef _LZ_H_
+#define _LZ_H_
+
+// Compress size bytes of in into out, which holds capacity bytes.
+// Returns the compressed size, or 0 if it does not fit in capacity.
+int lzCompress(const unsigned char *in, int size, unsigned char *out, int capacity);
+
+// Decompress size bytes of in into out, which holds capacity bytes.
+// Returns the decompressed size, or -1 if the input is malformed or too large.
+int lzDecompress(const unsigned char *in, int size, unsigned char *out, int capacity);
+
+#endif // _LZ_H_
@@ -0,0 +1,52 @@
+// File prefetch header.
+// The file is memory mapped and a reader thread faults it in ahead of the transmitter,
+// handing over chunks of the mapping through a ring.
+
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
+
+// Chunks read ahead of the one being sent.
+#define PREFETCH_SLOTS 8
+
+typedef struct
+{
+    const unsigned char *data; // Chunk of the mapping, already read from disk
+    int size;                  // Bytes in the chunk, 0 at the end of the file
+} PrefetchChunk;
+
+// Single-producer/single-consumer ring. Each side owns its index and slots are
+// handed over with two counting semaphores, so neither side takes a lock.
+typedef struct
+{
+    const unsigned char *map;
+    size_t fileSize;
+    size_t start;     // Offset of the first chunk
+    int chunkSize;
+    PrefetchChunk slots[PREFETCH_SLOTS];
+    int readIdx;  // Next slot filled by the reader thread
+    int sendIdx;  // Next slot taken by the transmitter
+    sem_t filled; // Slots ready to be sent
+    sem_t free;   // Slots ready to be filled
+    pthread_t thread;
+} Prefetcher;
+
+// Map the fileSize bytes of the file open as fd and start reading it from offset
+// start in chunks of chunkSize bytes.
+// Returns 0 on success, -1 on error.
+int prefetchStart(Prefetcher *prefetcher, int fd, size_t fileSize, size_t start, int chunkSize);
+
+// Wait for the next chunk. It stays valid until prefetchStop.
+PrefetchChunk *prefetchNext(Prefetcher *prefetcher);
+
+// Let the reader thread reuse the slot of the chunk returned by prefetchNext.
+void prefetchRelease(Prefetcher *prefetcher);
+
+// Wait for the reader thread to finish and unmap the file. Must only be called
+// after the chunk ending the file was taken.
+void prefetchStop(Prefetcher *prefetcher);
+
+#endif // _PREFETCH_H_
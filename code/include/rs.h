@@ -0,0 +1,46 @@
+// Reed-Solomon header.
+// RS(255,223) over GF(256), interleaved across a block so bursts of errors are spread.
+
+#ifndef _RS_H_
+#define _RS_H_
+
+// Data and parity bytes of each codeword; each corrects up to RS_PARITY_SIZE / 2 bytes.
+#define RS_DATA_SIZE 223
+#define RS_PARITY_SIZE 32
+#define RS_CODEWORD_SIZE (RS_DATA_SIZE + RS_PARITY_SIZE)
+
+// Codewords protecting size bytes, and the size of the encoded block.
+#define RS_CODEWORDS(size) (((size) + RS_DATA_SIZE - 1) / RS_DATA_SIZE)
+#define RS_ENCODED_SIZE(size) ((size) + RS_PARITY_SIZE * RS_CODEWORDS(size))
+
+// Largest block supported, in codewords.
+#define RS_MAX_CODEWORDS 512
+
+// A block of size bytes is followed by its parity. Byte i of the block belongs to
+// codeword i % codewords, and so does parity byte i of the parity, so a burst of
+// errors touches every codeword once before it touches any of them twice.
+typedef struct
+{
+    int codewords;
+    int next; // Codeword of the next byte
+    unsigned char parity[RS_MAX_CODEWORDS][RS_PARITY_SIZE];
+} RsEncoder;
+
+// Start encoding a block of size bytes, at most RS_MAX_CODEWORDS * RS_DATA_SIZE.
+void rsEncodeStart(RsEncoder *encoder, int size);
+
+// Encode the next size bytes of the block.
+void rsEncodeUpdate(RsEncoder *encoder, const unsigned char *data, int size);
+
+// Write the parity of the block into parity, which must hold
+// RS_PARITY_SIZE * RS_CODEWORDS(size) bytes. Returns its size.
+int rsEncodeFinish(RsEncoder *encoder, unsigned char *parity);
+
+// Size of the block whose encoded size is size, or -1 if no block encodes to it.
+int rsDataSize(int size);
+
+// Correct the errors of an encoded block of size bytes in place.
+// Returns the number of bytes corrected, or -1 if some codeword has too many errors.
+int rsDecode(unsigned char *block, int size);
+
+#endif // _RS_H_
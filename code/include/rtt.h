@@ -0,0 +1,32 @@
+// Round trip time estimator header.
+// Jacobson/Karels smoothed RTT and retransmission timeout (RFC 6298).
+
+#ifndef _RTT_H_
+#define _RTT_H_
+
+// Bounds of the retransmission timeout, in microseconds.
+#define RTT_MIN_RTO 10000LL
+#define RTT_MAX_RTO 60000000LL
+
+typedef struct
+{
+    long long srtt;    // Smoothed round trip time (usec)
+    long long rttvar;  // Round trip time variation (usec)
+    long long rto;     // Current retransmission timeout (usec)
+    long long minRtt;  // Smallest sample (usec)
+    long long maxRtt;  // Largest sample (usec)
+    unsigned int samples;
+    unsigned int backoffs;
+} RttEstimator;
+
+// Start with no samples and the given timeout.
+void rttInit(RttEstimator *est, long long initialRto);
+
+// Add a round trip time sample. Samples must only come from frames that were
+// not retransmitted (Karn's algorithm).
+void rttSample(RttEstimator *est, long long rtt);
+
+// Double the timeout after a retransmission timeout.
+void rttBackoff(RttEstimator *est);
+
+#endif // _RTT_H_
@@ -0,0 +1,23 @@
+// Byte stuffing header.
+// Escaping of FLAG and ESCAPE bytes in the information field of I frames.
+
+#ifndef _STUFFING_H_
+#define _STUFFING_H_
+
+#define STUFF_FLAG 0x7E
+#define STUFF_ESCAPE 0x7D
+#define STUFF_XOR 0x20
+
+// Stuff size bytes of data into out, which must hold at least 2 * size bytes.
+// Every data byte is also XORed into *bcc2.
+// Returns the number of bytes written to out.
+int stuffBytes(unsigned char *out, const unsigned char *data, int size, unsigned char *bcc2);
+
+// Destuff bytes from in into out (at most outCapacity bytes), XORing every destuffed
+// byte into *bcc2. Stops before a FLAG, before an ESCAPE that ends the input or is not
+// followed by a valid escaped byte, or when out is full, leaving that byte to the caller.
+// Returns the number of input bytes consumed; *outSize receives the bytes written.
+int destuffBytes(unsigned char *out, int outCapacity, int *outSize,
+                 const unsigned char *in, int size, unsigned char *bcc2);
+
+#endif // _STUFFING_H_
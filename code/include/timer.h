@@ -0,0 +1,32 @@
+// Timer header.
+// Monotonic clock timers used to schedule retransmissions.
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+typedef struct
+{
+    long long deadline; // Expiration time, in microseconds of the monotonic clock
+    int active;
+} Timer;
+
+// Current time of the monotonic clock in microseconds, or of the virtual clock if in use.
+long long timerNow();
+
+// Arm the timer to expire durationUs microseconds from now.
+void timerStart(Timer *timer, long long durationUs);
+
+// Disarm the timer.
+void timerStop(Timer *timer);
+
+// Return TRUE if the timer is armed and its deadline is not after now.
+int timerExpired(const Timer *timer, long long now);
+
+// Milliseconds until the timer expires (rounded up), suitable as a poll timeout.
+// Returns -1 if the timer is not armed.
+int timerPollTimeout(const Timer *timer, long long now);
+
+// Earliest of two poll timeouts, where -1 means no timeout.
+int timerMinTimeout(int timeoutMs, int otherMs);
+
+#endif // _TIMER_H_
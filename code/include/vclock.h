@@ -0,0 +1,66 @@
+// Virtual clock header.
+// Simulated time shared with the virtual cable, so transfers run faster than real time.
+
+#ifndef _VCLOCK_H_
+#define _VCLOCK_H_
+
+#include <poll.h>
+
+// Environment variable naming the clock file, created by the cable.
+#define VCLOCK_ENV "LL_VCLOCK"
+
+// How often a wait checks whether the virtual clock reached its end, in nanoseconds
+// of real time.
+#define VCLOCK_TICK 50000
+
+// Serial ports of the cable, in the order of VirtualClock.port.
+#define VCLOCK_TX 0
+#define VCLOCK_RX 1
+
+// Layout of the clock file; cable/cable.c keeps a copy of it.
+// Only the cable advances the time, when neither end can do anything before it does:
+// both wait on their serial port (or cannot write to it) and have read every byte the
+// cable delivered. Both sides count the bytes they move for the cable to tell.
+typedef struct
+{
+    long long now; // Virtual time in nanoseconds
+    struct
+    {
+        int attached;                 // Set while a process uses the port
+        unsigned int changes;         // Counts the threads starting or stopping a wait
+        int polling;                  // Threads waiting in vclockPoll (one at most)
+        int blocked;                  // Threads waiting in vclockWrite for the port
+        int writing;                  // Threads in vclockWrite, not waiting
+        long long wakeAt;             // Virtual time the vclockPoll wait ends, -1 for none
+        unsigned long long written;   // Bytes the end wrote to the serial port
+        unsigned long long read;      // Bytes the end read from the serial port
+        unsigned long long received;  // Bytes the cable read from the port
+        unsigned long long delivered; // Bytes the cable wrote to the port
+    } port[2];
+} VirtualClock;
+
+// Attach to the virtual clock named by LL_VCLOCK as the end of the given port,
+// if the variable is set.
+// Returns 0 on success (or if not set), -1 on error.
+int vclockOpen(int port);
+
+// Detach from the virtual clock.
+void vclockClose();
+
+// Return TRUE if the virtual clock is in use.
+int vclockActive();
+
+// Current virtual time in microseconds.
+long long vclockNow();
+
+// Like poll on one file descriptor, but the timeout runs in virtual time.
+int vclockPoll(struct pollfd *pfd, int timeoutMs);
+
+// Like write, counting the bytes for the cable. While the serial port is full, the
+// cable may move the clock until the line takes the bytes.
+int vclockWrite(int fd, const unsigned char *bytes, int size);
+
+// Count the bytes read from the serial port.
+void vclockRead(int bytes);
+
+#endif // _VCLOCK_H_
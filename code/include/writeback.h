@@ -0,0 +1,46 @@
+// Write-behind header.
+// A background thread flushes the received part of a memory mapped output file.
+
+#ifndef _WRITEBACK_H_
+#define _WRITEBACK_H_
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Bytes received before the flusher thread is woken up.
+#define WRITEBACK_CHUNK (1024 * 1024)
+// Longest time received bytes wait to be flushed, in milliseconds, so slow
+// links still get regular checkpoints.
+#define WRITEBACK_INTERVAL_MS 2000
+
+// Called from the flusher thread once the first flushed bytes are on disk.
+typedef void (*WriteBackCallback)(void *context, size_t flushed);
+
+typedef struct
+{
+    unsigned char *map; // Output file mapping
+    size_t size;        // Size of the mapping
+    size_t ready;       // Bytes received from the start of the mapping
+    size_t flushed;     // Bytes already written to disk
+    int done;           // No more bytes will be received
+    WriteBackCallback onFlushed;
+    void *context;
+    pthread_mutex_t lock; // Protects ready and done, never held while flushing
+    pthread_cond_t cond;
+    pthread_t thread;
+} WriteBack;
+
+// Start flushing the size bytes mapped at map as they are received, the first
+// start bytes being on disk already. onFlushed may be NULL.
+// Returns 0 on success, -1 on error.
+int writebackStart(WriteBack *wb, unsigned char *map, size_t size, size_t start,
+                   WriteBackCallback onFlushed, void *context);
+
+// Mark the first ready bytes of the mapping as received.
+void writebackAdvance(WriteBack *wb, size_t ready);
+
+// Flush what is left and wait for the flusher thread to finish.
+// Returns 0 on success, -1 if a flush failed.
+int writebackFinish(WriteBack *wb);
+
+#endif // _WRITEBACK_H_
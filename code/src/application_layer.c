@@ -1,28 +1,150 @@
 // Application layer protocol implementation
 
+#define _XOPEN_SOURCE 700 // nftw
 #include "application_layer.h"
 #include "link_layer.h"
+#include "link_layer_ext.h"
+#include "prefetch.h"
+#include "writeback.h"
+#include "journal.h"
+#include "lz.h"
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #define PACKET_START    0x01
 #define PACKET_DATA     0x02
 #define PACKET_END      0x03
+#define PACKET_DONE     0x04 // Ends a batch session
 #define PACKET_FSIZE    0x00
+#define PACKET_FNAME    0x01
+#define PACKET_FTIME    0x02
+#define PACKET_FOFFSET  0x03
+#define PACKET_FCODEC   0x04 // Compression of the data packets, none if missing
+#define PACKET_FTYPE    0x05 // Kind of entry of a batch session, a file if missing
+
+#define ENTRY_FILE      0
+#define ENTRY_DIRECTORY 1    // Only the START packet, with no data packets or END
+
+// Resume offer of the receiver in llopen: file size, file time and bytes received
+#define RESUME_OFFER_SIZE 24
+
+// Largest payload proposed unless LL_PAYLOAD is set; the receiver reads data packets
+// straight into the file, so it is not bound by MAX_PAYLOAD_SIZE buffers
+#define DEFAULT_PAYLOAD 4096
+
+// Data packets: C, N (2 bytes), offset in the file (8 bytes), L2, L1, then the data
+#define DATA_HEADER_SIZE 13
+#define DATA_SEQ_MODULUS 65536
+
+// Compressed data packets carry a block: method, length of the file data it holds
+// (2 bytes), then the data, stored as is when compressing does not make it smaller
+#define BLOCK_HEADER_SIZE 3
+#define BLOCK_STORED 0
+#define BLOCK_LZ 1
+
+typedef enum {
+    CodecNone,
+    CodecLz,
+} Codec;
+
+// Compression of the files sent, from the environment (see loadLinkOptions)
+static Codec codec = CodecNone;
+
+// Print every data packet, from the environment (see loadLinkOptions)
+static int verbose = 0;
+
+// Progress reports travel on their own logical channel, ahead of the data packets:
+// bytes of file data sent (8 bytes) and milliseconds since llopen (8 bytes).
+// An empty report is the last one.
+#define CHANNEL_PROGRESS 1
+#define PROGRESS_PRIORITY 1
+#define PROGRESS_REPORT_SIZE 16
+
+// Interval of the progress reports in milliseconds, 0 for none (see loadLinkOptions)
+static int progressInterval = 0;
+
+// File data sent so far, reported by the progress thread until progressDone is set
+static pthread_mutex_t progressLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progressChanged = PTHREAD_COND_INITIALIZER;
+static uint64_t progressBytes = 0;
+static int progressDone = 0;
+
+// Writes the bytes least significant bytes of value into out, most significant first
+void putNumber(unsigned char *out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
 
-int sendControlPacket(unsigned char control, size_t size) {
-    unsigned char packet[MAX_PAYLOAD_SIZE] = {0};
+// Reads a number of the given bytes, most significant first
+uint64_t getNumber(const unsigned char *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+// File described by the control packets
+typedef struct {
+    uint64_t size;
+    int64_t time;    // Modification time at the transmitter, identifies the file version
+    uint64_t offset; // Where the data packets start, 0 unless resuming
+    Codec codec;     // Compression of the data packets
+    char name[256];  // Path relative to the directory of a batch session, empty otherwise
+    int type;        // ENTRY_FILE, or ENTRY_DIRECTORY for a directory of a batch session
+} FileInfo;
+
+// Control packets carry the file size, time and starting offset as TLV parameters of 8
+// bytes, followed by the compression if any, and the kind of entry and its name in
+// batch sessions
+int sendControlPacket(unsigned char control, const FileInfo *info) {
+    unsigned char packet[31 + 3 + 3 + 2 + 255] = {0};
+    int packetSize = 31;
 
     packet[0] = control;
     packet[1] = PACKET_FSIZE;
-    packet[2] = 4;
-    packet[3] = size >> 24;
-    packet[4] = (size >> 16) & 0xFF;
-    packet[5] = (size >> 8) & 0xFF;
-    packet[6] = size & 0xFF;
+    packet[2] = 8;
+    putNumber(&packet[3], info->size, 8);
+    packet[11] = PACKET_FTIME;
+    packet[12] = 8;
+    putNumber(&packet[13], info->time, 8);
+    packet[21] = PACKET_FOFFSET;
+    packet[22] = 8;
+    putNumber(&packet[23], info->offset, 8);
+
+    if (info->codec != CodecNone) {
+        packet[packetSize++] = PACKET_FCODEC;
+        packet[packetSize++] = 1;
+        packet[packetSize++] = info->codec;
+    }
+
+    if (info->type != ENTRY_FILE) {
+        packet[packetSize++] = PACKET_FTYPE;
+        packet[packetSize++] = 1;
+        packet[packetSize++] = info->type;
+    }
 
-    if ((llwrite(packet, 7) == -1)) {
+    int nameLength = strlen(info->name);
+    if (nameLength > 0) {
+        packet[packetSize++] = PACKET_FNAME;
+        packet[packetSize++] = nameLength;
+        memcpy(&packet[packetSize], info->name, nameLength);
+        packetSize += nameLength;
+    }
+
+    if ((llwrite(packet, packetSize) == -1)) {
         printf("Error sending control packet!\n");
         exit(-1);
     } else {
@@ -32,144 +154,698 @@ int sendControlPacket(unsigned char control, size_t size) {
     return 0;
 }
 
-int receiveControlPacket(unsigned char control, size_t *size) {
-    unsigned char packet[MAX_PAYLOAD_SIZE] = {0};
-    llread(packet);
+// Sends the control packet ending a batch session
+int sendDonePacket() {
+    unsigned char packet[1] = {PACKET_DONE};
 
-    if (packet[0] != control) {
+    if (llwrite(packet, 1) == -1) {
+        printf("Error sending control packet!\n");
+        exit(-1);
+    }
+    printf("Control packet sent!\n");
+    return 0;
+}
+
+// Reads the next packet of channel. Until the thread reading the other channel reads its
+// first packet, its frames filling the window fail the read with EAGAIN: waits in
+// llpoll for the link to change and retries.
+int receivePacket(int channel, const struct iovec *iov, int iovcnt) {
+    int size;
+    while ((size = llreadch(channel, iov, iovcnt)) < 0 && errno == EAGAIN) {
+        if (llpoll(-1) < 0) {
+            return -1;
+        }
+    }
+    return size;
+}
+
+// Reads a control packet and its TLV parameters, skipping unknown ones.
+// Numbers of 1 to 8 bytes are accepted, so 4 byte sizes of older senders still work;
+// the time and offset are 0, the data is not compressed and the name is empty if missing.
+// Returns the control field (START, END or DONE).
+int receiveControlPacket(FileInfo *info) {
+    unsigned char packet[MAX_PAYLOAD_SIZE] = {0};
+    struct iovec iov = {.iov_base = packet, .iov_len = sizeof(packet)};
+    int packetSize = receivePacket(LL_DEFAULT_CHANNEL, &iov, 1);
+    int sizeFound = FALSE;
+    info->time = 0;
+    info->offset = 0;
+    info->codec = CodecNone;
+    info->name[0] = '\0';
+    info->type = ENTRY_FILE;
+
+    if (packetSize < 1 || (packet[0] != PACKET_START && packet[0] != PACKET_END && packet[0] != PACKET_DONE)) {
         printf("Error receiving control packet on byte 0!\n");
         exit(-1);
     }
 
-    if (packet[1] != PACKET_FSIZE) {
-        printf("Error receiving control packeton byte 1!\n");
+    if (packet[0] == PACKET_DONE) {
+        printf("Control packet received!\n");
+        return PACKET_DONE;
+    }
+
+    if (packetSize > (int)sizeof(packet)) {
+        packetSize = sizeof(packet);
+    }
+
+    for (int idx = 1; idx + 2 <= packetSize && idx + 2 + packet[idx + 1] <= packetSize; idx += 2 + packet[idx + 1]) {
+        unsigned char type = packet[idx], length = packet[idx + 1];
+        if (type == PACKET_FNAME) {
+            memcpy(info->name, &packet[idx + 2], length);
+            info->name[length] = '\0';
+            continue;
+        }
+        if (length < 1 || length > 8) {
+            continue;
+        }
+        if (type == PACKET_FSIZE) {
+            info->size = getNumber(&packet[idx + 2], length);
+            sizeFound = TRUE;
+        } else if (type == PACKET_FTIME) {
+            info->time = getNumber(&packet[idx + 2], length);
+        } else if (type == PACKET_FOFFSET) {
+            info->offset = getNumber(&packet[idx + 2], length);
+        } else if (type == PACKET_FCODEC) {
+            info->codec = getNumber(&packet[idx + 2], length);
+        } else if (type == PACKET_FTYPE) {
+            info->type = getNumber(&packet[idx + 2], length);
+        }
+    }
+
+    if (info->codec != CodecNone && info->codec != CodecLz) {
+        printf("Error receiving control packet! Unknown compression.\n");
         exit(-1);
     }
 
-    if (packet[2] != 4) {
-        printf("Error receiving control packet on byte 2!\n");
+    if (info->type != ENTRY_FILE && (info->type != ENTRY_DIRECTORY || info->name[0] == '\0')) {
+        printf("Error receiving control packet! Unknown entry.\n");
         exit(-1);
     }
 
-    *size = (packet[3] << 24) | (packet[4] << 16) | (packet[5] << 8) | packet[6];
+    if (!sizeFound) {
+        printf("Error receiving control packet! No file size.\n");
+        exit(-1);
+    }
 
     printf("Control packet received!\n");
 
-    return 0;
+    return packet[0];
 }
 
 
-int sendFile(const char *filename)
+// Prints how much smaller the data packets were than the file data they carried
+void printCompression(uint64_t fileBytes, uint64_t packetBytes) {
+    printf("Compression: %llu bytes in %llu (ratio %.2f)\n", (unsigned long long)fileBytes,
+           (unsigned long long)packetBytes, packetBytes > 0 ? (double)fileBytes / packetBytes : 1.0);
+}
+
+// Sends a file; name is its path in a batch session, NULL for a single file
+int sendFile(const char *filename, const char *name)
 {
-    FILE *file = fopen(filename, "rb");
+    int file = open(filename, O_RDONLY);
+    struct stat info;
 
-    if (file == NULL) {
+    if (file < 0 || fstat(file, &info) != 0) {
         printf("Error opening file!\n");
         exit(-1);
     }
 
-    fseek(file, 0, SEEK_END);
-    size_t size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    FileInfo fileInfo = {.size = info.st_size, .time = info.st_mtime, .offset = 0, .codec = codec};
+    if (name != NULL) {
+        strcpy(fileInfo.name, name);
+    }
+
+    // Continues where the receiver stopped if it offered to resume this version of the file
+    unsigned char offer[LL_MAX_OPEN_DATA];
+    if (name == NULL && llgetopendata(offer) == RESUME_OFFER_SIZE && getNumber(offer, 8) == fileInfo.size &&
+        (int64_t)getNumber(&offer[8], 8) == fileInfo.time && getNumber(&offer[16], 8) <= fileInfo.size) {
+        fileInfo.offset = getNumber(&offer[16], 8);
+        printf("Resuming at byte %llu\n", (unsigned long long)fileInfo.offset);
+    }
 
-    if (sendControlPacket(PACKET_START, size) != 0) {
+    if (sendControlPacket(PACKET_START, &fileInfo) != 0) {
         printf("Error sending control packet!\n");
-        fclose(file);
+        close(file);
         exit(-1);
     }
 
-    int packetNumber = 0, bytesRead = 0;
-    unsigned char buffer[MAX_PAYLOAD_SIZE] = {0};
-
-    while ((bytesRead = fread(buffer, 1, MAX_PAYLOAD_SIZE, file)) > 0) {
-        printf("\nPacket Number: %d\n", packetNumber);
-        unsigned char packet[MAX_PAYLOAD_SIZE + 4];
-        packet[0] = PACKET_DATA;
-        packet[1] = packetNumber;
-        packet[2] = (bytesRead >> 8) & 0xFF;
-        packet[3] = bytesRead & 0xFF;
-
-        memcpy(&packet[4], buffer, bytesRead);
+    // Data packets carry at most what the link layer negotiated in llopen, and less
+    // on noisy lines as suggested by the link layer before each packet.
+    // The file is mapped and read ahead by a reader thread in chunks of the largest
+    // payload; llwritev stuffs each packet header and its part of the chunk straight
+    // into the frame, so the data is never copied before that.
+    // With compression, each packet holds a block of what the suggested payload would
+    // hold uncompressed, so a packet never grows beyond it.
+    LinkLayerOptions options;
+    llgetoptions(&options);
+    unsigned char *compressed = NULL;
+    if (fileInfo.codec == CodecLz && (compressed = malloc(options.maxPayload)) == NULL) {
+        printf("Error allocating compression buffer!\n");
+        close(file);
+        exit(-1);
+    }
+    Prefetcher prefetcher;
+    int chunkSize = compressed != NULL ? options.maxPayload - BLOCK_HEADER_SIZE : options.maxPayload;
+    if (prefetchStart(&prefetcher, file, fileInfo.size, fileInfo.offset, chunkSize) != 0) {
+        printf("Error starting file reader!\n");
+        close(file);
+        exit(-1);
+    }
 
-        if (llwrite(packet, bytesRead + 4) < 0) {
-            printf("Error sending data packet!\n");
-            fclose(file);
-            exit(-1);
+    int packetNumber = 0;
+    uint64_t fileOffset = fileInfo.offset;
+    uint64_t bytesSent = 0;
+    PrefetchChunk *chunk;
+
+    while ((chunk = prefetchNext(&prefetcher))->size > 0) {
+        for (int offset = 0; offset < chunk->size; ) {
+            int bytesRead = llsuggestpayload();
+            if (compressed != NULL) {
+                bytesRead -= BLOCK_HEADER_SIZE;
+            }
+            if (bytesRead > chunk->size - offset) {
+                bytesRead = chunk->size - offset;
+            }
+
+            if (verbose) {
+                printf("\nPacket Number: %d\n", packetNumber);
+            }
+            unsigned char header[DATA_HEADER_SIZE];
+            unsigned char block[BLOCK_HEADER_SIZE];
+            struct iovec packet[3] = {
+                {.iov_base = header, .iov_len = sizeof(header)},
+                {.iov_base = block, .iov_len = 0},
+                {.iov_base = (unsigned char *)&chunk->data[offset], .iov_len = bytesRead}};
+
+            if (compressed != NULL) {
+                int compressedSize = lzCompress(&chunk->data[offset], bytesRead, compressed, bytesRead - 1);
+                block[0] = compressedSize > 0 ? BLOCK_LZ : BLOCK_STORED;
+                putNumber(&block[1], bytesRead, 2);
+                packet[1].iov_len = BLOCK_HEADER_SIZE;
+                if (compressedSize > 0) {
+                    packet[2].iov_base = compressed;
+                    packet[2].iov_len = compressedSize;
+                }
+            }
+
+            int packetSize = packet[1].iov_len + packet[2].iov_len;
+            header[0] = PACKET_DATA;
+            putNumber(&header[1], packetNumber, 2);
+            putNumber(&header[3], fileOffset, 8);
+            putNumber(&header[11], packetSize, 2);
+
+            if (llwritev(packet, 3) < 0) {
+                printf("Error sending data packet!\n");
+                close(file);
+                exit(-1);
+            }
+
+            llrecordpayload(bytesRead);
+            pthread_mutex_lock(&progressLock);
+            progressBytes += bytesRead;
+            pthread_mutex_unlock(&progressLock);
+
+            offset += bytesRead;
+            fileOffset += bytesRead;
+            bytesSent += packetSize;
+            packetNumber = (packetNumber + 1) % DATA_SEQ_MODULUS;
         }
-
-        packetNumber = (packetNumber + 1) % 100;
+        prefetchRelease(&prefetcher);
     }
+    prefetchStop(&prefetcher);
+    free(compressed);
 
+    if (fileInfo.codec != CodecNone) {
+        printCompression(fileOffset - fileInfo.offset, bytesSent);
+    }
 
-    if (sendControlPacket(PACKET_END, size) != 0) {
+    if (sendControlPacket(PACKET_END, &fileInfo) != 0) {
         printf("Error sending control packet!\n");
-        fclose(file);
+        close(file);
         exit(-1);
     }
 
-    fclose(file);
+    close(file);
     return 0;
 }
 
-int receiveFile(const char *filename)
+// Decompresses the block of a data packet into out, which has room for capacity bytes.
+// Returns the size of the file data, or -1 if the block is malformed.
+int decompressBlock(const unsigned char *block, int size, unsigned char *out, uint64_t capacity) {
+    if (size < BLOCK_HEADER_SIZE) {
+        return -1;
+    }
+
+    int length = getNumber(&block[1], 2);
+    if ((uint64_t)length > capacity) {
+        return -1;
+    }
+
+    if (block[0] == BLOCK_STORED && size - BLOCK_HEADER_SIZE == length) {
+        memcpy(out, &block[BLOCK_HEADER_SIZE], length);
+        return length;
+    }
+    if (block[0] == BLOCK_LZ &&
+        lzDecompress(&block[BLOCK_HEADER_SIZE], size - BLOCK_HEADER_SIZE, out, length) == length) {
+        return length;
+    }
+    return -1;
+}
+
+// Offers the transmitter to resume the file if its journal shows a previous transfer
+// stopped midway. Must be called before llopen.
+void offerResume(const char *filename) {
+    Journal journal;
+    struct stat info;
+
+    if (journalLoad(&journal, filename) != 0 || stat(filename, &info) != 0) {
+        return;
+    }
+
+    unsigned char offer[RESUME_OFFER_SIZE];
+    putNumber(offer, journal.fileSize, 8);
+    putNumber(&offer[8], journal.fileTime, 8);
+    putNumber(&offer[16], journal.received, 8);
+    llsetopendata(offer, RESUME_OFFER_SIZE);
+    printf("Offering to resume at byte %llu\n", (unsigned long long)journal.received);
+}
+
+// Records in the journal what the write-behind thread flushed
+void journalFlushed(void *context, size_t flushed) {
+    if (journalUpdate(context, flushed) != 0) {
+        perror("Error updating journal");
+    }
+}
+
+// The output file is preallocated with the size in the START packet and mapped, so
+// llreadv places each payload at its offset in the file and the disk writes are left
+// to a write-behind thread. The mapping has room for one more packet than expected,
+// so a packet larger than the rest of the file cannot overflow it.
+// Compressed packets are read into a buffer instead, and decompressed into the map.
+// A journal next to the file records what is on disk, so an interrupted transfer
+// can resume; it is removed once the file is complete.
+// Receives the file announced by the START packet start
+int receiveFile(const char *filename, const FileInfo *start)
 {
-    FILE *file = fopen(filename, "wb");
+    int file = open(filename, O_RDWR | O_CREAT, 0644);
 
-    if (file == NULL) {
+    if (file < 0) {
         printf("Error opening file!\n");
         exit(-1);
     }
 
-    size_t filesize = 0;
+    FileInfo fileInfo = *start;
+    uint64_t filesize = fileInfo.size;
 
-    if (receiveControlPacket(PACKET_START, &filesize) != 0) {
-        printf("Error receiving control packet!\n");
-        fclose(file);
+    // The transmitter only resumes what this receiver offered in llopen
+    Journal journal;
+    if (fileInfo.offset > 0) {
+        if (journalLoad(&journal, filename) != 0 || journal.fileSize != fileInfo.size ||
+            journal.fileTime != fileInfo.time || journal.received < fileInfo.offset) {
+            printf("Error resuming file! No matching journal.\n");
+            close(file);
+            exit(-1);
+        }
+        printf("Resuming at byte %llu\n", (unsigned long long)fileInfo.offset);
+    } else if (ftruncate(file, 0) != 0) {
+        printf("Error truncating file!\n");
+        close(file);
+        exit(-1);
+    }
+
+    if (journalOpen(&journal, filename, fileInfo.size, fileInfo.time, fileInfo.offset) != 0) {
+        printf("Error creating journal!\n");
+        close(file);
         exit(-1);
     }
 
-    unsigned char buffer[MAX_PAYLOAD_SIZE] = {0};
-    size_t bytesWritten = 0;
+    LinkLayerOptions options;
+    llgetoptions(&options);
+    size_t mapSize = filesize + options.maxPayload + LL_PACKET_HEADER_SIZE;
+    int error = posix_fallocate(file, 0, filesize);
+    if (error != 0 && error != EOPNOTSUPP && error != EINVAL) {
+        printf("Error allocating file: %s\n", strerror(error));
+        close(file);
+        exit(-1);
+    }
+
+    unsigned char *map = MAP_FAILED;
+    if (ftruncate(file, mapSize) == 0) {
+        map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    }
+
+    WriteBack writeback;
+    if (map == MAP_FAILED ||
+        writebackStart(&writeback, map, filesize, fileInfo.offset, journalFlushed, &journal) != 0) {
+        printf("Error mapping file!\n");
+        close(file);
+        exit(-1);
+    }
+
+    unsigned char *block = NULL;
+    if (fileInfo.codec == CodecLz && (block = malloc(options.maxPayload + LL_PACKET_HEADER_SIZE)) == NULL) {
+        printf("Error allocating compression buffer!\n");
+        close(file);
+        exit(-1);
+    }
+
+    uint64_t bytesWritten = fileInfo.offset;
+    uint64_t bytesReceived = 0;
     int packetNumber = 0;
 
     while (bytesWritten < filesize) {
-        printf("\nPacket number: %d\n", packetNumber);
-        unsigned char packet[MAX_PAYLOAD_SIZE + 4] = {0};
-        int bytesSent = llread(packet);
+        if (verbose) {
+            printf("\nPacket number: %d\n", packetNumber);
+        }
+        unsigned char header[DATA_HEADER_SIZE] = {0};
+        struct iovec iov[2] = {
+            {.iov_base = header, .iov_len = sizeof(header)},
+            {.iov_base = map + bytesWritten, .iov_len = mapSize - bytesWritten}};
+        if (block != NULL) {
+            iov[1].iov_base = block;
+            iov[1].iov_len = options.maxPayload + LL_PACKET_HEADER_SIZE;
+        }
+        int bytesSent = receivePacket(LL_DEFAULT_CHANNEL, iov, 2);
 
-        if (packet[0] != PACKET_DATA) {
+        if (header[0] != PACKET_DATA) {
             printf("Error receiving data packet!\n");
-            fclose(file);
+            close(file);
             exit(-1);
         }
 
-        if (packet[1] != packetNumber) {
+        if (getNumber(&header[1], 2) != (uint64_t)packetNumber || getNumber(&header[3], 8) != bytesWritten) {
             printf("Error receiving data packet! Wrong packet number.\n");
-            fclose(file);
+            close(file);
             exit(-1);
         }
 
         if (bytesSent > 0) {
-            int size = packet[2] * 256 + packet[3];
-            memcpy(buffer, &packet[4], size);
+            int size = getNumber(&header[11], 2);
+            if (size != bytesSent - DATA_HEADER_SIZE) {
+                printf("Error receiving data packet! Wrong size.\n");
+                close(file);
+                exit(-1);
+            }
+            bytesReceived += size;
+
+            if (block != NULL) {
+                size = decompressBlock(block, size, map + bytesWritten, filesize - bytesWritten);
+            }
+            if (size < 0 || (uint64_t)size > filesize - bytesWritten) {
+                printf("Error receiving data packet! Wrong size.\n");
+                close(file);
+                exit(-1);
+            }
+
+            bytesWritten += size;
+            writebackAdvance(&writeback, bytesWritten);
+            if (verbose) {
+                printf("Written %llu bytes\n", (unsigned long long)bytesWritten);
+            }
+
+            packetNumber = (packetNumber + 1) % DATA_SEQ_MODULUS;
+        }
+    }
+
+    if (receiveControlPacket(&fileInfo) != PACKET_END) {
+        printf("Error receiving control packet!\n");
+        close(file);
+        exit(-1);
+    }
+
+    free(block);
+    if (fileInfo.codec != CodecNone) {
+        printCompression(bytesWritten - fileInfo.offset, bytesReceived);
+    }
+
+    int result = writebackFinish(&writeback);
+    munmap(map, mapSize);
+    if (result != 0 || ftruncate(file, bytesWritten) != 0) {
+        printf("Error writing file!\n");
+        close(file);
+        exit(-1);
+    }
 
-            bytesWritten += fwrite(buffer, 1, size, file);
-            printf("Written %d bytes\n", bytesWritten);
+    journalRemove(&journal);
+    close(file);
+    return 0;
+}
 
-            packetNumber = (packetNumber + 1) % 100;
+// Checks that a received file name stays inside the batch directory
+int safeName(const char *name) {
+    if (name[0] == '/') {
+        return FALSE;
+    }
+    for (const char *part = name; part != NULL; part = strchr(part, '/'), part = part ? part + 1 : NULL) {
+        if (strncmp(part, "..", 2) == 0 && (part[2] == '/' || part[2] == '\0')) {
+            return FALSE;
         }
     }
+    return TRUE;
+}
+
+// Creates the missing directories of path
+void makeParents(char *path) {
+    for (char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
+    }
+}
+
+// Path of the batch directory sending files, used by sendEntry
+const char *batchRoot;
+
+// Sends a directory entry, so the receiver creates it even if it holds no files
+int sendDirectory(const char *name) {
+    FileInfo fileInfo = {.size = 0, .time = 0, .offset = 0, .codec = CodecNone, .type = ENTRY_DIRECTORY};
+    strcpy(fileInfo.name, name);
+    return sendControlPacket(PACKET_START, &fileInfo);
+}
+
+int sendEntry(const char *path, const struct stat *info, int type, struct FTW *ftw) {
+    if (ftw->level == 0 || (type != FTW_D && (type != FTW_F || !S_ISREG(info->st_mode)))) {
+        return 0;
+    }
+
+    const char *name = path + strlen(batchRoot);
+    while (*name == '/') {
+        name++;
+    }
+    if (strlen(name) > 255) {
+        printf("Skipping %s: name too long\n", path);
+        return 0;
+    }
+    return type == FTW_D ? sendDirectory(name) : sendFile(path, name);
+}
+
+// Sends every directory and regular file under directory in one session, each
+// directory before what it holds; each file starts right after the END packet of the
+// previous one, which is still in the window
+int sendBatch(const char *directory) {
+    batchRoot = directory;
+    if (nftw(directory, sendEntry, 16, FTW_PHYS) != 0) {
+        printf("Error reading directory!\n");
+        exit(-1);
+    }
+    return sendDonePacket();
+}
+
+// Sends a single file, or a batch session if path is a directory
+int sendPath(const char *path) {
+    struct stat info;
+
+    if (stat(path, &info) == 0 && S_ISDIR(info.st_mode)) {
+        return sendBatch(path);
+    }
+    return sendFile(path, NULL);
+}
 
-    if (receiveControlPacket(PACKET_END, &filesize) != 0) {
+// Receives a single file into filename, or a batch of files into the directory
+// filename when the START packets carry file names
+int receiveSession(const char *filename) {
+    FileInfo fileInfo;
+    int control = receiveControlPacket(&fileInfo);
+
+    // A batch of an empty directory is only the DONE packet
+    if (control == PACKET_DONE) {
+        mkdir(filename, 0755);
+        return 0;
+    }
+    if (control != PACKET_START) {
         printf("Error receiving control packet!\n");
-        fclose(file);
         exit(-1);
     }
 
-    fclose(file);
+    if (fileInfo.name[0] == '\0') {
+        return receiveFile(filename, &fileInfo);
+    }
+
+    mkdir(filename, 0755);
+    do {
+        if (!safeName(fileInfo.name)) {
+            printf("Error receiving file! Unsafe name %s\n", fileInfo.name);
+            exit(-1);
+        }
+
+        char path[4096];
+        if (snprintf(path, sizeof(path), "%s/%s", filename, fileInfo.name) >= (int)sizeof(path)) {
+            printf("Error receiving file! Name too long\n");
+            exit(-1);
+        }
+        makeParents(path);
+        if (fileInfo.type == ENTRY_DIRECTORY) {
+            mkdir(path, 0755);
+            continue;
+        }
+        printf("Receiving %s\n", path);
+        receiveFile(path, &fileInfo);
+    } while (receiveControlPacket(&fileInfo) == PACKET_START);
+
     return 0;
 }
 
+// Link layer options can be tuned through the environment, since the command
+// line (main.c) must not be changed:
+//   LL_WINDOW: window size (1 = stop-and-wait)
+//   LL_ARQ: "gbn" (go-back-N) or "sr" (selective repeat)
+//   LL_CHECK: "bcc2", "crc16" or "crc32"
+//   LL_PAYLOAD: largest payload of data packets
+//   LL_FEC: "rs" for Reed-Solomon forward error correction, "none" (default)
+//   LL_COMPRESS: "lz" to compress the files sent, "none" (default)
+//   LL_DUPLEX: file sent back by the receiver in the same session; the transmitter
+//              names where it is saved
+//   LL_PROGRESS: interval in milliseconds of the progress reports the transmitter
+//                sends on a second logical channel
+//   LL_VERBOSE: set to print every frame and data packet
+void loadLinkOptions(LinkLayerOptions *options)
+{
+    const char *value;
+
+    options->windowSize = LL_DEFAULT_WINDOW;
+    options->arqMode = LL_DEFAULT_ARQ;
+    options->frameCheck = LL_DEFAULT_FRAME_CHECK;
+    options->maxPayload = DEFAULT_PAYLOAD;
+    options->fec = LL_DEFAULT_FEC;
+    options->channels = LL_DEFAULT_CHANNELS;
+
+    if ((value = getenv("LL_WINDOW")) != NULL) {
+        options->windowSize = atoi(value);
+    }
+
+    if ((value = getenv("LL_ARQ")) != NULL) {
+        options->arqMode = strcmp(value, "sr") == 0 ? ArqSelectiveRepeat : ArqGoBackN;
+    }
+
+    if ((value = getenv("LL_CHECK")) != NULL) {
+        options->frameCheck = strcmp(value, "bcc2") == 0  ? FrameCheckBcc2
+                              : strcmp(value, "crc16") == 0 ? FrameCheckCrc16
+                                                            : FrameCheckCrc32;
+    }
+
+    if ((value = getenv("LL_PAYLOAD")) != NULL) {
+        options->maxPayload = atoi(value);
+    }
+
+    if ((value = getenv("LL_FEC")) != NULL) {
+        options->fec = strcmp(value, "rs") == 0 ? FecReedSolomon : FecNone;
+    }
+
+    options->duplex = getenv("LL_DUPLEX") != NULL;
+
+    if ((value = getenv("LL_COMPRESS")) != NULL) {
+        codec = strcmp(value, "lz") == 0 ? CodecLz : CodecNone;
+    }
+
+    if ((value = getenv("LL_PROGRESS")) != NULL && (progressInterval = atoi(value)) > 0) {
+        options->channels = CHANNEL_PROGRESS + 1;
+    }
+
+    verbose = getenv("LL_VERBOSE") != NULL;
+    llsetverbose(verbose);
+}
+
+// In full duplex the direction opposite to the role runs in a second thread
+void *sendThread(void *path) {
+    if (sendPath(path) == -1) {
+        printf("Failed to sendFile\n");
+        exit(-1);
+    }
+    return NULL;
+}
+
+void *receiveThread(void *path) {
+    if (receiveSession(path) == -1) {
+        printf("Failed to receiveFile\n");
+        exit(-1);
+    }
+    return NULL;
+}
+
+// Sends a progress report every progressInterval milliseconds until the transfer is done
+void *progressThread(void *unused) {
+    (void)unused;
+    struct timespec start, deadline;
+    clock_gettime(CLOCK_REALTIME, &start);
+    deadline = start;
+
+    pthread_mutex_lock(&progressLock);
+    while (!progressDone) {
+        deadline.tv_sec += progressInterval / 1000;
+        deadline.tv_nsec += (progressInterval % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!progressDone && pthread_cond_timedwait(&progressChanged, &progressLock, &deadline) == 0) {
+        }
+        if (progressDone) {
+            break;
+        }
+
+        unsigned char report[PROGRESS_REPORT_SIZE];
+        uint64_t elapsed = (deadline.tv_sec - start.tv_sec) * 1000 + (deadline.tv_nsec - start.tv_nsec) / 1000000;
+        putNumber(report, progressBytes, 8);
+        putNumber(&report[8], elapsed, 8);
+        pthread_mutex_unlock(&progressLock);
+
+        struct iovec iov = {.iov_base = report, .iov_len = sizeof(report)};
+        if (llwritech(CHANNEL_PROGRESS, &iov, 1) < 0) {
+            printf("Error sending progress report!\n");
+            exit(-1);
+        }
+        pthread_mutex_lock(&progressLock);
+    }
+    pthread_mutex_unlock(&progressLock);
+
+    struct iovec last = {.iov_base = NULL, .iov_len = 0};
+    if (llwritech(CHANNEL_PROGRESS, &last, 1) < 0) {
+        printf("Error sending progress report!\n");
+        exit(-1);
+    }
+    return NULL;
+}
+
+// Prints the progress reports of the transmitter until the last one
+void *progressReader(void *unused) {
+    (void)unused;
+    unsigned char report[PROGRESS_REPORT_SIZE];
+    struct iovec iov = {.iov_base = report, .iov_len = sizeof(report)};
+    int size;
+
+    while ((size = receivePacket(CHANNEL_PROGRESS, &iov, 1)) > 0) {
+        if (size == PROGRESS_REPORT_SIZE) {
+            printf("\nTransmitter progress: %llu bytes in %.1f s\n", (unsigned long long)getNumber(report, 8),
+                   getNumber(&report[8], 8) / 1000.0);
+        }
+    }
+    if (size < 0) {
+        printf("Error receiving progress report!\n");
+        exit(-1);
+    }
+    return NULL;
+}
+
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
                       int nTries, int timeout, const char *filename)
 {
@@ -181,23 +857,59 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
 
     strcpy(layer.serialPort, serialPort);
 
+    LinkLayerOptions options;
+    loadLinkOptions(&options);
+    // The receiver prints the progress reports of any transmitter that sends them
+    if (layer.role == LlRx && options.channels <= CHANNEL_PROGRESS) {
+        options.channels = CHANNEL_PROGRESS + 1;
+    }
+    llsetoptions(&options);
+
+    // Whoever receives may offer to resume; in full duplex the transmitter receives too
+    const char *duplexPath = getenv("LL_DUPLEX");
+    if (layer.role == LlRx) {
+        offerResume(filename);
+    } else if (duplexPath != NULL) {
+        offerResume(duplexPath);
+    }
+
     if (llopen(layer) != 1)
     {
         printf("Failed to do llopen\n");
         exit(-1);
     }
 
+    llgetoptions(&options);
+    pthread_t duplexThread;
+    if (options.duplex &&
+        pthread_create(&duplexThread, NULL, layer.role == LlTx ? receiveThread : sendThread, (void *)duplexPath) != 0) {
+        printf("Failed to start duplex thread\n");
+        exit(-1);
+    } else if (!options.duplex && duplexPath != NULL) {
+        printf("Peer does not support full duplex\n");
+    }
+
+    pthread_t progress;
+    int reporting = options.channels > CHANNEL_PROGRESS;
+    if (reporting && layer.role == LlTx) {
+        llsetpriority(CHANNEL_PROGRESS, PROGRESS_PRIORITY);
+    }
+    if (reporting && pthread_create(&progress, NULL, layer.role == LlTx ? progressThread : progressReader, NULL) != 0) {
+        printf("Failed to start progress thread\n");
+        exit(-1);
+    }
+
     switch (layer.role)
     {
     case LlTx:
-        if (sendFile(filename) == -1)
+        if (sendPath(filename) == -1)
         {
             printf("Failed to sendFile\n");
             exit(-1);
         }
         break;
     case LlRx:
-        if (receiveFile(filename) == -1)
+        if (receiveSession(filename) == -1)
         {
             printf("Failed to receiveFile\n");
             exit(-1);
@@ -207,6 +919,18 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
         break;
     }
 
+    if (reporting) {
+        pthread_mutex_lock(&progressLock);
+        progressDone = 1;
+        pthread_cond_signal(&progressChanged);
+        pthread_mutex_unlock(&progressLock);
+        pthread_join(progress, NULL);
+    }
+
+    if (options.duplex) {
+        pthread_join(duplexThread, NULL);
+    }
+
     if (llclose(1) == -1)
     {
         printf("Failed to do llclose\n");
@@ -0,0 +1,89 @@
+// CRC implementation
+// Slicing-by-8: eight tables let each iteration fold 8 bytes with independent
+// lookups instead of a dependent lookup per byte.
+
+#include "crc.h"
+
+#define CRC16_POLY 0x8408     // 0x1021 reflected
+#define CRC32_POLY 0xEDB88320 // 0x04C11DB7 reflected
+
+static uint16_t crc16Table[8][256];
+static uint32_t crc32Table[8][256];
+static int tablesReady = 0;
+
+static void initTables()
+{
+    for (int i = 0; i < 256; i++) {
+        uint16_t c16 = i;
+        uint32_t c32 = i;
+        for (int bit = 0; bit < 8; bit++) {
+            c16 = (c16 & 1) ? (c16 >> 1) ^ CRC16_POLY : c16 >> 1;
+            c32 = (c32 & 1) ? (c32 >> 1) ^ CRC32_POLY : c32 >> 1;
+        }
+        crc16Table[0][i] = c16;
+        crc32Table[0][i] = c32;
+    }
+
+    // Table k gives the CRC of a byte followed by k zero bytes
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint16_t prev16 = crc16Table[k - 1][i];
+            uint32_t prev32 = crc32Table[k - 1][i];
+            crc16Table[k][i] = (prev16 >> 8) ^ crc16Table[0][prev16 & 0xFF];
+            crc32Table[k][i] = (prev32 >> 8) ^ crc32Table[0][prev32 & 0xFF];
+        }
+    }
+
+    tablesReady = 1;
+}
+
+uint16_t crc16Update(uint16_t crc, const unsigned char *data, int size)
+{
+    if (!tablesReady) {
+        initTables();
+    }
+
+    for (; size >= 8; data += 8, size -= 8) {
+        uint16_t low = crc ^ (data[0] | data[1] << 8);
+        crc = crc16Table[7][low & 0xFF] ^ crc16Table[6][low >> 8] ^
+              crc16Table[5][data[2]] ^ crc16Table[4][data[3]] ^
+              crc16Table[3][data[4]] ^ crc16Table[2][data[5]] ^
+              crc16Table[1][data[6]] ^ crc16Table[0][data[7]];
+    }
+
+    for (; size > 0; data++, size--) {
+        crc = (crc >> 8) ^ crc16Table[0][(crc ^ *data) & 0xFF];
+    }
+    return crc;
+}
+
+uint32_t crc32Update(uint32_t crc, const unsigned char *data, int size)
+{
+    if (!tablesReady) {
+        initTables();
+    }
+
+    for (; size >= 8; data += 8, size -= 8) {
+        uint32_t low = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 |
+                              (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        crc = crc32Table[7][low & 0xFF] ^ crc32Table[6][(low >> 8) & 0xFF] ^
+              crc32Table[5][(low >> 16) & 0xFF] ^ crc32Table[4][low >> 24] ^
+              crc32Table[3][data[4]] ^ crc32Table[2][data[5]] ^
+              crc32Table[1][data[6]] ^ crc32Table[0][data[7]];
+    }
+
+    for (; size > 0; data++, size--) {
+        crc = (crc >> 8) ^ crc32Table[0][(crc ^ *data) & 0xFF];
+    }
+    return crc;
+}
+
+uint16_t crc16(const unsigned char *data, int size)
+{
+    return ~crc16Update(CRC16_INIT, data, size);
+}
+
+uint32_t crc32(const unsigned char *data, int size)
+{
+    return ~crc32Update(CRC32_INIT, data, size);
+}
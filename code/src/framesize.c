@@ -0,0 +1,108 @@
+// Frame size estimator implementation
+// With a byte error probability p, a frame of n payload bytes and H overhead bytes
+// arrives intact with probability (1 - p)^(n + H), so the useful throughput is
+// proportional to n / (n + H) * (1 - p)^(n + H). Taking -ln(1 - p) ~ p, it is
+// maximal for n^2 + H n = H / p. The probability p is estimated as the ratio of
+// failed frames to bytes sent, which holds while frames rarely fail more than once.
+
+#include "framesize.h"
+
+// Square root by Newton's method, since libm is not linked
+static double squareRoot(double x)
+{
+    if (x <= 0) {
+        return 0;
+    }
+
+    double root = x > 1 ? x : 1;
+    for (int i = 0; i < 64; i++) {
+        double next = (root + x / root) / 2;
+        if (next >= root) {
+            break;
+        }
+        root = next;
+    }
+    return root;
+}
+
+void sizerInit(FrameSizer *sizer, int initialPayload, int maxPayload)
+{
+    sizer->bytes = 0;
+    sizer->errors = 0;
+    sizer->cleanBytes = 0;
+    sizer->maxPayload = maxPayload;
+    sizer->payload = initialPayload < maxPayload ? initialPayload : maxPayload;
+    sizer->smallest = 0;
+    sizer->largest = 0;
+    sizer->changes = 0;
+    sizer->frames = 0;
+    sizer->payloadBytes = 0;
+    sizer->lastPayload = 0;
+}
+
+void sizerSent(FrameSizer *sizer, int frameBytes)
+{
+    sizer->bytes += frameBytes;
+    sizer->cleanBytes += frameBytes;
+    if (sizer->bytes > SIZER_MEMORY_BYTES) {
+        sizer->bytes /= 2;
+        sizer->errors /= 2;
+    }
+}
+
+void sizerError(FrameSizer *sizer)
+{
+    sizer->errors++;
+    sizer->cleanBytes = 0;
+}
+
+int sizerSuggest(FrameSizer *sizer, double overheadBytes)
+{
+    int optimum = sizer->maxPayload;
+
+    if (sizer->errors > 0 && sizer->bytes > 0) {
+        double p = sizer->errors / sizer->bytes;
+        double n = (squareRoot(overheadBytes * overheadBytes + 4 * overheadBytes / p) - overheadBytes) / 2;
+        if (n < optimum) {
+            optimum = (int)n;
+        }
+    }
+
+    // Shrink at once, but only grow (at most doubling) after SIZER_GROWTH_FRAMES frames
+    // of the current size went through without errors
+    if (optimum > sizer->payload) {
+        if (sizer->cleanBytes < SIZER_GROWTH_FRAMES * sizer->payload) {
+            optimum = sizer->payload;
+        } else {
+            sizer->cleanBytes = 0;
+            if (optimum > 2 * sizer->payload) {
+                optimum = 2 * sizer->payload;
+            }
+        }
+    }
+    if (optimum < SIZER_MIN_PAYLOAD) {
+        optimum = SIZER_MIN_PAYLOAD;
+    }
+    if (optimum > sizer->maxPayload) {
+        optimum = sizer->maxPayload;
+    }
+
+    sizer->payload = optimum;
+    return optimum;
+}
+
+void sizerRecord(FrameSizer *sizer, int payload)
+{
+    if (sizer->frames == 0 || payload < sizer->smallest) {
+        sizer->smallest = payload;
+    }
+    if (sizer->frames == 0 || payload > sizer->largest) {
+        sizer->largest = payload;
+    }
+    if (sizer->frames > 0 && payload != sizer->lastPayload) {
+        sizer->changes++;
+    }
+    sizer->lastPayload = payload;
+    sizer->frames++;
+    sizer->payloadBytes += payload;
+}
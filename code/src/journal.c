@@ -0,0 +1,107 @@
+// Checkpoint journal implementation
+// The journal is a single 32 byte record (magic, file size, file time and bytes
+// received, big endian) rewritten in place and synced after every update.
+
+#include "journal.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC "RCOMJRN1"
+#define JOURNAL_RECORD_SIZE 32
+
+static void putField(unsigned char *out, uint64_t value)
+{
+    for (int i = 7; i >= 0; i--) {
+        out[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+static uint64_t getField(const unsigned char *in)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+static int journalPath(Journal *journal, const char *filename)
+{
+    int length = snprintf(journal->path, sizeof(journal->path), "%s%s", filename, JOURNAL_SUFFIX);
+    return length < (int)sizeof(journal->path) ? 0 : -1;
+}
+
+static int journalWrite(Journal *journal)
+{
+    unsigned char record[JOURNAL_RECORD_SIZE];
+    memcpy(record, JOURNAL_MAGIC, 8);
+    putField(&record[8], journal->fileSize);
+    putField(&record[16], journal->fileTime);
+    putField(&record[24], journal->received);
+
+    if (pwrite(journal->fd, record, JOURNAL_RECORD_SIZE, 0) != JOURNAL_RECORD_SIZE) {
+        return -1;
+    }
+    return fdatasync(journal->fd);
+}
+
+int journalLoad(Journal *journal, const char *filename)
+{
+    unsigned char record[JOURNAL_RECORD_SIZE];
+    journal->fd = -1;
+
+    if (journalPath(journal, filename) != 0) {
+        return -1;
+    }
+
+    int fd = open(journal->path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    int size = read(fd, record, JOURNAL_RECORD_SIZE);
+    close(fd);
+
+    if (size != JOURNAL_RECORD_SIZE || memcmp(record, JOURNAL_MAGIC, 8) != 0) {
+        return -1;
+    }
+
+    journal->fileSize = getField(&record[8]);
+    journal->fileTime = getField(&record[16]);
+    journal->received = getField(&record[24]);
+    return journal->received <= journal->fileSize ? 0 : -1;
+}
+
+int journalOpen(Journal *journal, const char *filename, uint64_t fileSize, int64_t fileTime, uint64_t received)
+{
+    if (journalPath(journal, filename) != 0) {
+        return -1;
+    }
+
+    journal->fd = open(journal->path, O_WRONLY | O_CREAT, 0644);
+    if (journal->fd < 0) {
+        return -1;
+    }
+
+    journal->fileSize = fileSize;
+    journal->fileTime = fileTime;
+    journal->received = received;
+    return journalWrite(journal);
+}
+
+int journalUpdate(Journal *journal, uint64_t received)
+{
+    journal->received = received;
+    return journalWrite(journal);
+}
+
+void journalRemove(Journal *journal)
+{
+    if (journal->fd >= 0) {
+        close(journal->fd);
+        journal->fd = -1;
+    }
+    unlink(journal->path);
+}
@@ -1,12 +1,22 @@
 // Link layer protocol implementation
 
 #include "link_layer.h"
+#include "link_layer_ext.h"
 #include "serial_port.h"
+#include "timer.h"
+#include "rtt.h"
+#include "stuffing.h"
+#include "crc.h"
+#include "framesize.h"
+#include "rs.h"
+#include "vclock.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
-#include <signal.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include <sys/time.h>
 
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
@@ -24,6 +34,44 @@
 #define C_I1            0x80
 #define ESCAPE          0x7D
 
+// Windowed mode control fields: frame type in the lower nibble, N(s)/N(r) in the upper one.
+// The types are chosen so that neither C nor A ^ C (BCC1) is ever FLAG or ESCAPE, for
+// either address and any sequence number, as the header is not stuffed.
+#define C_WIN_I         0x00
+#define C_WIN_RR        0x01
+#define C_WIN_REJ       0x05
+#define C_WIN_SREJ      0x09
+
+// Parameters carried (type, length, value) in the information field of SET and UA
+#define PARAM_WINDOW    0x01
+#define PARAM_ARQ       0x02
+#define PARAM_CHECK     0x03
+#define PARAM_PAYLOAD   0x04
+#define PARAM_OPEN_DATA 0x05
+#define PARAM_FEC       0x06
+#define PARAM_DUPLEX    0x07
+#define PARAM_CHANNELS  0x08
+
+// Largest negotiation parameters and SET/UA frame carrying them
+#define MAX_PARAMS_SIZE (25 + 2 + LL_MAX_OPEN_DATA)
+#define MAX_OPEN_FRAME_SIZE (4 + 2 * (MAX_PARAMS_SIZE + 1) + 1)
+
+// Bytes read from the serial port at once
+#define RX_BUFFER_SIZE  4096
+// Largest information field accepted (application packet plus its header)
+#define MAX_INFO_SIZE   (LL_MAX_PAYLOAD_SIZE + LL_PACKET_HEADER_SIZE)
+// Largest frame check (CRC-32)
+#define MAX_CHECK_SIZE  4
+// Acknowledgement carried by I frames in full duplex
+#define ACK_SIZE        1
+// Logical channel of I frames when several are multiplexed
+#define CHANNEL_SIZE    1
+// Largest information field: acknowledgement, channel, data, frame check and forward
+// error correction parity
+#define MAX_FIELD_SIZE  RS_ENCODED_SIZE(ACK_SIZE + CHANNEL_SIZE + MAX_INFO_SIZE + MAX_CHECK_SIZE)
+// Largest stuffed I frame: header, stuffed information field, and closing FLAG
+#define MAX_FRAME_SIZE  (4 + 2 * MAX_FIELD_SIZE + 1)
+
 typedef enum {
     START,
     FLAG_RCV,
@@ -35,117 +83,829 @@ typedef enum {
     ESCAPE_STATE
 } State;
 
+typedef enum {
+    FRAME_I,
+    FRAME_RR,
+    FRAME_REJ,
+    FRAME_SREJ,
+    FRAME_SET,
+    FRAME_UA,
+    FRAME_DISC,
+    FRAME_OTHER
+} FrameType;
+
+// Frame being assembled from the received bytes
+typedef struct {
+    State state;
+    unsigned char address;
+    unsigned char control;
+    unsigned char data[MAX_FIELD_SIZE]; // Destuffed information field, frame check included
+    int size;
+    unsigned char bcc2;                    // XOR of the destuffed bytes, 0 if BCC2 matches
+} FrameReceiver;
+
+// Sent I frame kept until acknowledged
+typedef struct {
+    unsigned char frame[MAX_FRAME_SIZE];
+    int size;
+    int fieldSize;         // Destuffed acknowledgement and data, without the frame check
+    Timer timer;           // Retransmission timer of this frame
+    int timeouts;          // Consecutive timeouts of this frame
+    int sends;             // Number of times the frame was sent
+    long long sentAt;      // Estimated time the last transmission left the serial port (usec)
+    long long firstSentAt; // Time of the first transmission (usec)
+    LlWriteCallback done;  // Called once acknowledged, for frames written by llwriteasync
+    void *context;
+} TxSlot;
+
+// Outcome of an asynchronous write, reported by the next llpoll
+typedef struct {
+    LlWriteCallback done;
+    void *context;
+    int result;
+} Completion;
+
+// Received I frame kept until delivered in order (within its channel)
+typedef struct {
+    unsigned char data[MAX_INFO_SIZE];
+    int size;
+    int channel;
+    int valid;
+    int srejSent;
+} RxSlot;
+
 // Variables used in the process
 LinkLayer parameters;
-State state = START;
+// Callers of llsetoptions know packets may exceed MAX_PAYLOAD_SIZE; llread relies on it
+int optionsSet = FALSE;
+LinkLayerOptions proposedOptions = {LL_DEFAULT_WINDOW, LL_DEFAULT_ARQ, LL_DEFAULT_FRAME_CHECK, LL_DEFAULT_PAYLOAD,
+                                   LL_DEFAULT_FEC, LL_DEFAULT_DUPLEX, LL_DEFAULT_CHANNELS};
+FrameReceiver receiver;
+unsigned char rxBuffer[RX_BUFFER_SIZE];
+int rxBufferPos = 0;
+int rxBufferSize = 0;
 extern int fd;
-volatile int waitAlarm = FALSE;
-unsigned char control_flag = 0;
-int currSeq = 0;
-int alarmCount = 0;
+long long timeoutUs = 0;
+RttEstimator rtt;
+FrameSizer sizer;
+long long txIdleAt = 0; // Estimated time the serial port finishes sending what was written (usec)
+
+// Negotiated sliding window
+int windowSize = 1;
+int seqModulus = 2;
+ArqMode arqMode = ArqGoBackN;
+FrameCheck frameCheck = FrameCheckBcc2;
+const char *frameCheckNames[] = {"BCC2", "CRC-16", "CRC-32"};
+int maxPayload = MAX_PAYLOAD_SIZE;
+FecMode fecMode = FecNone;
+RsEncoder rsEncoder;
+int duplex = FALSE;
+// I frames of each direction, and the RR/REJ/SREJ answering them, carry the address
+// of their transmitter: A_TRANS for the transmitter, A_RECEIV for the receiver
+unsigned char txAddress = A_TRANS;
+unsigned char rxAddress = A_TRANS;
+
+// Logical channels: writers waiting for the window are served by priority
+int channels = 1;
+int channelPriority[LL_MAX_CHANNELS];
+int waitingWriters[LL_MAX_CHANNELS];
+
+// Asynchronous API: writes not reported yet (in the window or in completions) and the
+// channels whose packets are handed to a callback by llpoll
+Completion completions[LL_SEQ_MODULUS];
+int completionCount = 0;
+int asyncWrites = 0;
+LlReadCallback readCallbacks[LL_MAX_CHANNELS];
+void *readContexts[LL_MAX_CHANNELS];
+
+// Thread that last read each channel (or polled, for the channels with a callback),
+// which a reader waiting for room in the receiver window relies on
+pthread_t channelReaders[LL_MAX_CHANNELS];
+int channelRead[LL_MAX_CHANNELS];
+pthread_t pollThread;
+int polled = FALSE;
+unsigned char uaFrame[MAX_OPEN_FRAME_SIZE];
+int uaFrameSize = 0;
+
+// Application data exchanged in SET/UA
+unsigned char openData[LL_MAX_OPEN_DATA];
+int openDataSize = 0;
+unsigned char peerOpenData[LL_MAX_OPEN_DATA];
+int peerOpenDataSize = 0;
+
+// Transmitter window: frames windowBase..nextSeq-1 are waiting for acknowledgement
+TxSlot txWindow[LL_SEQ_MODULUS];
+int windowBase = 0;
+int nextSeq = 0;
+
+// Receiver window: frames nextDeliver..expectedSeq-1 are waiting for llread
+RxSlot rxWindow[LL_SEQ_MODULUS];
+int expectedSeq = 0;
+int nextDeliver = 0;
+int rejSent = FALSE;
+int ackPending = FALSE; // RR owed for the received I frames
+
+// Every entry point holds linkLock. In full duplex llwrite and llread may block in two
+// threads at once: only one of them waits on the serial port (polling), releasing the
+// lock meanwhile, and the other waits for it to process what arrives. The lock is also
+// released while writing, so the serial port is read while a long frame is sent.
+pthread_mutex_t linkLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t linkChanged;
+int polling = FALSE;
+int writing = FALSE;
 
 // Statistics Variables
 unsigned int totalFramesSent = 0;
 unsigned int totalFramesReceived = 0;
 unsigned int retransmissions = 0;
-unsigned int totalDataBytes = 0; 
-struct timeval start_time, end_time;
+unsigned long long totalDataBytes = 0;
+unsigned int correctedFrames = 0;
+unsigned int correctedBytes = 0;
+unsigned int uncorrectableFrames = 0;
+long long startTime; // usec
+
+// Per-frame progress messages, off unless llsetverbose is called
+int verbose = FALSE;
+
+void llsetoptions(const LinkLayerOptions *newOptions) {
+    proposedOptions = *newOptions;
+    optionsSet = TRUE;
+}
 
-void alarmHandler(int signal)
-{
-    waitAlarm = FALSE;
-    printf("Couldnt receive frame\n");
-    alarmCount++;
+void llsetverbose(int enabled) {
+    verbose = enabled;
+}
+
+void llsetopendata(const unsigned char *data, int size) {
+    openDataSize = size < 0 ? 0 : size > LL_MAX_OPEN_DATA ? LL_MAX_OPEN_DATA : size;
+    memcpy(openData, data, openDataSize);
 }
 
-void alarmInit() {
-    waitAlarm = TRUE;
-    alarm(parameters.timeout);
+int llgetopendata(unsigned char *data) {
+    memcpy(data, peerOpenData, peerOpenDataSize);
+    return peerOpenDataSize;
 }
 
+void llgetoptions(LinkLayerOptions *options) {
+    options->windowSize = windowSize;
+    options->arqMode = arqMode;
+    options->frameCheck = frameCheck;
+    options->maxPayload = maxPayload;
+    options->fec = fecMode;
+    options->duplex = duplex;
+    options->channels = channels;
+}
 
-// State machine used in llopen and llwrite
-void handleState(unsigned char byte) {
-    switch (state) {
+void llsetpriority(int channel, int priority) {
+    if (channel >= 0 && channel < LL_MAX_CHANNELS) {
+        pthread_mutex_lock(&linkLock);
+        channelPriority[channel] = priority;
+        pthread_mutex_unlock(&linkLock);
+    }
+}
+
+// Distance from a to b in the sequence number space
+int seqDistance(int a, int b) {
+    return (b - a + seqModulus) % seqModulus;
+}
+
+unsigned char controlI(int seq) {
+    if (seqModulus == 2) {
+        return seq ? C_I1 : C_I0;
+    }
+    return C_WIN_I | (seq << 4);
+}
+
+unsigned char controlRR(int seq) {
+    if (seqModulus == 2) {
+        return seq ? C_RR1 : C_RR0;
+    }
+    return C_WIN_RR | (seq << 4);
+}
+
+unsigned char controlREJ(int seq) {
+    if (seqModulus == 2) {
+        return seq ? C_REJ1 : C_REJ0;
+    }
+    return C_WIN_REJ | (seq << 4);
+}
+
+// Classify a control field and extract its sequence number
+FrameType decodeControl(unsigned char control, int *seq) {
+    *seq = 0;
+    switch (control) {
+        case C_SET: return FRAME_SET;
+        case C_UA: return FRAME_UA;
+        case C_DISC: return FRAME_DISC;
+        default: break;
+    }
+
+    if (seqModulus == 2) {
+        switch (control) {
+            case C_I0: return FRAME_I;
+            case C_I1: *seq = 1; return FRAME_I;
+            case C_RR0: return FRAME_RR;
+            case C_RR1: *seq = 1; return FRAME_RR;
+            case C_REJ0: return FRAME_REJ;
+            case C_REJ1: *seq = 1; return FRAME_REJ;
+            default: return FRAME_OTHER;
+        }
+    }
+
+    *seq = control >> 4;
+    switch (control & 0x0F) {
+        case C_WIN_I: return FRAME_I;
+        case C_WIN_RR: return FRAME_RR;
+        case C_WIN_REJ: return FRAME_REJ;
+        case C_WIN_SREJ: return FRAME_SREJ;
+        default: return FRAME_OTHER;
+    }
+}
+
+// State machine shared by every frame type. Returns TRUE when a complete frame
+// is available in fr; its information field (if any) is destuffed into fr->data.
+int handleByte(FrameReceiver *fr, unsigned char byte) {
+    switch (fr->state) {
         case START:
             if (byte == FLAG) {
-                state = FLAG_RCV;
-            } else {
-                state = START;
+                fr->state = FLAG_RCV;
             }
             break;
         case FLAG_RCV:
-            if (byte == A_TRANS) {
-                state = A_RCV;
+            if (byte == A_TRANS || byte == A_RECEIV) {
+                fr->address = byte;
+                fr->state = A_RCV;
             } else if (byte != FLAG) {
-                state = START;
+                fr->state = START;
             }
             break;
         case A_RCV:
-            if ((parameters.role == LlTx && (byte == C_UA || byte == C_RR0 || byte == C_RR1 || byte == C_REJ0 || byte == C_REJ1)) || 
-                (parameters.role == LlRx && (byte == C_SET || byte == C_I0 || byte == C_I1))) {
-                control_flag = byte;
-                state = C_RCV;
-            } else if (byte == FLAG) {
-                state = FLAG_RCV;
+            if (byte == FLAG) {
+                fr->state = FLAG_RCV;
             } else {
-                state = START;
+                fr->control = byte;
+                fr->state = C_RCV;
             }
             break;
         case C_RCV:
-            if (byte == (A_TRANS ^ control_flag)) {
-                state = BCC_OK;
+            if (byte == (fr->address ^ fr->control)) {
+                fr->size = 0;
+                fr->bcc2 = 0;
+                fr->state = BCC_OK;
             } else if (byte == FLAG) {
-                state = FLAG_RCV;
+                fr->state = FLAG_RCV;
             } else {
-                state = START;
+                fr->state = START;
             }
             break;
         case BCC_OK:
+        case DATA:
             if (byte == FLAG) {
-                state = STOP_STATE;
-                printf("Frame received!\n");
+                // The closing FLAG may also open the next frame
+                fr->state = FLAG_RCV;
+                return TRUE;
+            } else if (byte == ESCAPE) {
+                fr->state = ESCAPE_STATE;
+            } else if (fr->size < (int)sizeof(fr->data)) {
+                fr->data[fr->size++] = byte;
+                fr->bcc2 ^= byte;
+                fr->state = DATA;
+            } else {
+                fr->state = START;
             }
             break;
-        case STOP_STATE:
-        case DATA:
         case ESCAPE_STATE:
+            if ((byte == (FLAG ^ 0x20) || byte == (ESCAPE ^ 0x20)) && fr->size < (int)sizeof(fr->data)) {
+                fr->data[fr->size++] = byte ^ 0x20;
+                fr->bcc2 ^= byte ^ 0x20;
+                fr->state = DATA;
+            } else if (byte == FLAG) {
+                fr->state = FLAG_RCV;
+            } else {
+                fr->state = START;
+            }
+            break;
+        case STOP_STATE:
         default:
+            fr->state = START;
             break;
     }
+    return FALSE;
 }
 
-// Function of the TX to send the SET frame and receive the UA frame
-int transmitterSETframe() {
-    (void)signal(SIGALRM, alarmHandler);
-    int bytesSent = 0;
-    unsigned char response = {0};
-    unsigned char frame[5] = {FLAG, A_TRANS, C_SET, A_TRANS ^ C_SET, FLAG};
-    printf("Sending SENT frame\n");
-    
-    alarmCount = 0;
-    while (alarmCount < parameters.nRetransmissions) {
-        if (!waitAlarm) {
-            bytesSent = write(fd, frame, 5);
-            printf("Written bytes on frame: %d\n", bytesSent);
-            if (bytesSent != 5) {
-                perror("Error writing frame");
-                return -1;
+// Waits up to timeoutMs (-1 waits forever) for another thread to finish waiting on
+// the serial port
+void waitPoller(int timeoutMs) {
+    if (timeoutMs < 0) {
+        pthread_cond_wait(&linkChanged, &linkLock);
+        return;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&linkChanged, &linkLock, &deadline);
+}
+
+void sendPendingAck();
+
+// Waits until no thread is writing to the serial port, so the frame it writes can be changed
+void waitWriter() {
+    while (writing) {
+        pthread_cond_wait(&linkChanged, &linkLock);
+    }
+}
+
+// Writes size bytes to the serial port, counting them for the virtual clock.
+// Returns the number of bytes written, -1 on error.
+int writePort(const unsigned char *bytes, int size) {
+    return vclockWrite(fd, bytes, size);
+}
+
+// Writes size bytes to the serial port, releasing linkLock meanwhile. An RR that became
+// due while writing is sent right after.
+// Returns the number of bytes written, -1 on error.
+int writeSerial(const unsigned char *bytes, int size) {
+    waitWriter();
+    writing = TRUE;
+    pthread_mutex_unlock(&linkLock);
+    int bytesWritten = writePort(bytes, size);
+    pthread_mutex_lock(&linkLock);
+    writing = FALSE;
+    pthread_cond_broadcast(&linkChanged);
+
+    sendPendingAck();
+    return bytesWritten;
+}
+
+// Waits up to timeoutMs (-1 waits forever) for the serial port to have data and
+// reads everything available at once. linkLock is released while waiting; if another
+// thread is already waiting on the serial port, waits for it instead and reads nothing.
+// Returns the number of bytes buffered, 0 on timeout, -1 on error.
+int fillRxBuffer(int timeoutMs) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+    if (polling) {
+        waitPoller(timeoutMs);
+        return 0;
+    }
+
+    polling = TRUE;
+    pthread_mutex_unlock(&linkLock);
+    int bytesRead = 0;
+    int ready = vclockPoll(&pfd, timeoutMs);
+    if (ready > 0) {
+        bytesRead = read(fd, rxBuffer, RX_BUFFER_SIZE);
+        vclockRead(bytesRead);
+    }
+    int error = ready < 0 || bytesRead < 0 ? errno : 0;
+    pthread_mutex_lock(&linkLock);
+    polling = FALSE;
+    pthread_cond_broadcast(&linkChanged);
+
+    if (error == EINTR) {
+        return 0;
+    }
+    if (error != 0) {
+        errno = error;
+        perror(ready < 0 ? "Error waiting for bytes" : "Error reading bytes");
+        return -1;
+    }
+
+    rxBufferPos = 0;
+    rxBufferSize = bytesRead;
+    return bytesRead;
+}
+
+// Feeds buffered bytes to the state machine, reading from the serial port at most
+// once (waiting up to timeoutMs) if they do not complete a frame.
+// Inside the information field, runs of bytes are destuffed in bulk and only the
+// bytes that stop the bulk routine (FLAG, escapes split between reads, errors) go
+// through the state machine.
+// Returns 1 if a frame was received, 0 if no frame is available yet, -1 on error.
+int readFrame(FrameReceiver *fr, int timeoutMs) {
+    for (int filled = FALSE; ; filled = TRUE) {
+        while (rxBufferPos < rxBufferSize) {
+            if (fr->state == BCC_OK || fr->state == DATA) {
+                int destuffed = 0;
+                rxBufferPos += destuffBytes(&fr->data[fr->size], sizeof(fr->data) - fr->size, &destuffed,
+                                            &rxBuffer[rxBufferPos], rxBufferSize - rxBufferPos, &fr->bcc2);
+                fr->size += destuffed;
+                if (destuffed > 0) {
+                    fr->state = DATA;
+                }
+                if (rxBufferPos == rxBufferSize) {
+                    break;
+                }
+            }
+
+            if (handleByte(fr, rxBuffer[rxBufferPos++])) {
+                return 1;
             }
-            alarmInit();
         }
 
-        int bytesResponse = read(fd, &response, 1);
+        if (filled) {
+            return 0;
+        }
+
+        int result = fillRxBuffer(timeoutMs);
+        if (result <= 0) {
+            return result;
+        }
+    }
+}
+
+// Waits for the next frame until the timer expires (forever if timer is NULL).
+// Returns 1 if a frame was received, 0 on timeout, -1 on error.
+int waitFrame(const Timer *timer) {
+    while (TRUE) {
+        long long now = timerNow();
+        if (timer != NULL && timerExpired(timer, now)) {
+            return 0;
+        }
+
+        int result = readFrame(&receiver, timer != NULL ? timerPollTimeout(timer, now) : -1);
+        if (result != 0) {
+            return result;
+        }
+    }
+}
+
+// Size of the frame check appended to the information field
+int checkSize(FrameCheck check) {
+    switch (check) {
+        case FrameCheckCrc16: return 2;
+        case FrameCheckCrc32: return 4;
+        default: return 1;
+    }
+}
+
+// Computes the frame check of the data in the iovcnt buffers of iov into fcs (CRCs
+// least significant byte first). bcc2 is the XOR of the data, already computed while
+// stuffing it. Returns the size of the frame check.
+int computeCheck(FrameCheck check, const struct iovec *iov, int iovcnt, unsigned char bcc2, unsigned char *fcs) {
+    uint32_t value = bcc2;
+    if (check == FrameCheckCrc16) {
+        uint16_t crc = CRC16_INIT;
+        for (int i = 0; i < iovcnt; i++) {
+            crc = crc16Update(crc, iov[i].iov_base, iov[i].iov_len);
+        }
+        value = (uint16_t)~crc;
+    } else if (check == FrameCheckCrc32) {
+        uint32_t crc = CRC32_INIT;
+        for (int i = 0; i < iovcnt; i++) {
+            crc = crc32Update(crc, iov[i].iov_base, iov[i].iov_len);
+        }
+        value = ~crc;
+    }
+
+    int fcsSize = checkSize(check);
+    for (int i = 0; i < fcsSize; i++) {
+        fcs[i] = value >> (8 * i);
+    }
+    return fcsSize;
+}
+
+// Checks the frame check at the end of the information field and strips it.
+// BCC2 is the XOR of the data, so the XOR of every received byte must be 0.
+int checkFrame(FrameReceiver *fr, FrameCheck check) {
+    int fcsSize = checkSize(check);
+    if (fr->size < fcsSize) {
+        return FALSE;
+    }
 
-        if (bytesResponse != 0) {
-            handleState(response);
+    if (check == FrameCheckBcc2) {
+        if (fr->bcc2 != 0) {
+            return FALSE;
         }
+    } else {
+        unsigned char fcs[MAX_CHECK_SIZE];
+        struct iovec iov = {.iov_base = fr->data, .iov_len = fr->size - fcsSize};
+        computeCheck(check, &iov, 1, 0, fcs);
+        if (memcmp(fcs, &fr->data[fr->size - fcsSize], fcsSize) != 0) {
+            return FALSE;
+        }
+    }
+    fr->size -= fcsSize;
+    return TRUE;
+}
+
+// XOR of size bytes of data (BCC2)
+unsigned char xorBytes(const unsigned char *data, int size) {
+    unsigned char bcc2 = 0;
+    for (int i = 0; i < size; i++) {
+        bcc2 ^= data[i];
+    }
+    return bcc2;
+}
 
-        if (state == STOP_STATE) {
-            alarm(0);
+// Checks an I frame, correcting it first if it carries forward error correction and
+// its frame check fails. The parity is stripped along with the frame check.
+int checkIFrame(FrameReceiver *fr) {
+    if (fecMode == FecNone) {
+        return checkFrame(fr, frameCheck);
+    }
+
+    int encodedSize = fr->size;
+    int dataSize = rsDataSize(encodedSize);
+    if (dataSize < 0) {
+        uncorrectableFrames++;
+        return FALSE;
+    }
+
+    // The BCC2 computed while destuffing covers the parity too
+    fr->size = dataSize;
+    fr->bcc2 = xorBytes(fr->data, dataSize);
+    if (checkFrame(fr, frameCheck)) {
+        return TRUE;
+    }
+
+    int corrected = rsDecode(fr->data, encodedSize);
+    if (corrected > 0) {
+        fr->bcc2 = xorBytes(fr->data, dataSize);
+    }
+    if (corrected <= 0 || !checkFrame(fr, frameCheck)) {
+        uncorrectableFrames++;
+        return FALSE;
+    }
+
+    correctedFrames++;
+    correctedBytes += corrected;
+    return TRUE;
+}
+
+// Stuffs a single byte into frame, returning the new index
+int stuffByte(unsigned char *frame, int idx, unsigned char byte) {
+    if (byte == FLAG || byte == ESCAPE) {
+        frame[idx++] = ESCAPE;
+        frame[idx++] = byte ^ 0x20;
+    } else {
+        frame[idx++] = byte;
+    }
+    return idx;
+}
+
+// Builds a frame with an information field (stuffed data followed by the frame check,
+// and by the parity of both with forward error correction) whose data is gathered
+// from the iovcnt buffers of iov
+// Returns the size of the frame
+int buildFrame(unsigned char *frame, unsigned char address, unsigned char control,
+               const struct iovec *iov, int iovcnt, FrameCheck check, FecMode fec) {
+    unsigned char bcc2 = 0;
+    unsigned char fcs[MAX_CHECK_SIZE];
+    int idx = 0;
+
+    // Frame's header
+    frame[idx++] = FLAG;
+    frame[idx++] = address;
+    frame[idx++] = control;
+    frame[idx++] = address ^ control;
+
+    // Adds data into the frame, computing BCC2 in the same pass
+    for (int i = 0; i < iovcnt; i++) {
+        idx += stuffBytes(&frame[idx], iov[i].iov_base, iov[i].iov_len, &bcc2);
+    }
+
+    int fcsSize = computeCheck(check, iov, iovcnt, bcc2, fcs);
+    for (int i = 0; i < fcsSize; i++) {
+        idx = stuffByte(frame, idx, fcs[i]);
+    }
+
+    if (fec == FecReedSolomon) {
+        static unsigned char parity[MAX_FIELD_SIZE - MAX_INFO_SIZE];
+        int dataSize = fcsSize;
+        for (int i = 0; i < iovcnt; i++) {
+            dataSize += iov[i].iov_len;
+        }
+        rsEncodeStart(&rsEncoder, dataSize);
+        for (int i = 0; i < iovcnt; i++) {
+            rsEncodeUpdate(&rsEncoder, iov[i].iov_base, iov[i].iov_len);
+        }
+        rsEncodeUpdate(&rsEncoder, fcs, fcsSize);
+        int paritySize = rsEncodeFinish(&rsEncoder, parity);
+        unsigned char unused = 0;
+        idx += stuffBytes(&frame[idx], parity, paritySize, &unused);
+    }
+    frame[idx++] = FLAG;
+    return idx;
+}
+
+// Sends a frame without information field
+int sendSupervision(unsigned char address, unsigned char control) {
+    unsigned char frame[5] = {FLAG, address, control, address ^ control, FLAG};
+    int bytesWritten = writeSerial(frame, 5);
+
+    if (bytesWritten != 5) {
+        perror("Error writing frame");
+        return -1;
+    }
+    return 0;
+}
+
+// Writes the negotiation parameters into data, returning their size
+int writeParameters(unsigned char *data, const LinkLayerOptions *options) {
+    int idx = 0;
+    data[idx++] = PARAM_WINDOW;
+    data[idx++] = 1;
+    data[idx++] = options->windowSize;
+    data[idx++] = PARAM_ARQ;
+    data[idx++] = 1;
+    data[idx++] = options->arqMode;
+    data[idx++] = PARAM_CHECK;
+    data[idx++] = 1;
+    data[idx++] = options->frameCheck;
+    data[idx++] = PARAM_PAYLOAD;
+    data[idx++] = 2;
+    data[idx++] = options->maxPayload >> 8;
+    data[idx++] = options->maxPayload & 0xFF;
+    if (options->channels > 1) {
+        data[idx++] = PARAM_CHANNELS;
+        data[idx++] = 1;
+        data[idx++] = options->channels;
+    }
+    if (options->duplex) {
+        data[idx++] = PARAM_DUPLEX;
+        data[idx++] = 1;
+        data[idx++] = TRUE;
+    }
+    if (options->fec != FecNone) {
+        data[idx++] = PARAM_FEC;
+        data[idx++] = 1;
+        data[idx++] = options->fec;
+    }
+    if (openDataSize > 0) {
+        data[idx++] = PARAM_OPEN_DATA;
+        data[idx++] = openDataSize;
+        memcpy(&data[idx], openData, openDataSize);
+        idx += openDataSize;
+    }
+    return idx;
+}
+
+// Reads the negotiation parameters, leaving missing and unknown ones untouched
+void readParameters(const unsigned char *data, int size, LinkLayerOptions *options) {
+    int idx = 0;
+    while (idx + 2 <= size && idx + 2 + data[idx + 1] <= size) {
+        unsigned char type = data[idx], length = data[idx + 1];
+        const unsigned char *value = &data[idx + 2];
+
+        if (type == PARAM_WINDOW && length == 1) {
+            options->windowSize = value[0];
+        } else if (type == PARAM_ARQ && length == 1) {
+            options->arqMode = value[0] == ArqSelectiveRepeat ? ArqSelectiveRepeat : ArqGoBackN;
+        } else if (type == PARAM_CHECK && length == 1 && value[0] <= FrameCheckCrc32) {
+            options->frameCheck = value[0];
+        } else if (type == PARAM_PAYLOAD && length == 2) {
+            options->maxPayload = value[0] << 8 | value[1];
+        } else if (type == PARAM_CHANNELS && length == 1) {
+            options->channels = value[0];
+        } else if (type == PARAM_DUPLEX && length == 1) {
+            options->duplex = value[0] != 0;
+        } else if (type == PARAM_FEC && length == 1 && value[0] <= FecReedSolomon) {
+            options->fec = value[0];
+        } else if (type == PARAM_OPEN_DATA && length <= LL_MAX_OPEN_DATA) {
+            memcpy(peerOpenData, value, length);
+            peerOpenDataSize = length;
+        }
+        idx += 2 + length;
+    }
+}
+
+// Clamps the window to what the sequence number space allows for the mode
+int limitWindow(int window, ArqMode mode) {
+    int maxWindow = mode == ArqSelectiveRepeat ? LL_MAX_WINDOW_SR : LL_MAX_WINDOW_GBN;
+    if (window < 1) {
+        return 1;
+    }
+    return window > maxWindow ? maxWindow : window;
+}
+
+// Clamps the payload to what the length field of data packets allows, and to at least
+// the smallest payload the frame sizer suggests
+int limitPayload(int payload) {
+    // Room for a data packet header and some data, also with compression
+    if (payload < SIZER_MIN_PAYLOAD) {
+        return SIZER_MIN_PAYLOAD;
+    }
+    return payload > LL_MAX_PAYLOAD_SIZE ? LL_MAX_PAYLOAD_SIZE : payload;
+}
+
+// Clamps the number of logical channels to the ones a frame can name
+int limitChannels(int count) {
+    if (count < 1) {
+        return 1;
+    }
+    return count > LL_MAX_CHANNELS ? LL_MAX_CHANNELS : count;
+}
+
+// Adopts the negotiated options and resets both windows
+void setOptions(const LinkLayerOptions *agreed) {
+    windowSize = limitWindow(agreed->windowSize, agreed->arqMode);
+    arqMode = agreed->arqMode;
+    frameCheck = agreed->frameCheck;
+    maxPayload = limitPayload(agreed->maxPayload);
+    fecMode = agreed->fec;
+    duplex = agreed->duplex;
+    channels = limitChannels(agreed->channels);
+    memset(waitingWriters, 0, sizeof(waitingWriters));
+    memset(channelRead, 0, sizeof(channelRead));
+    polled = FALSE;
+    completionCount = asyncWrites = 0;
+    txAddress = parameters.role == LlTx ? A_TRANS : A_RECEIV;
+    rxAddress = parameters.role == LlRx ? A_TRANS : A_RECEIV;
+    sizerInit(&sizer, MAX_PAYLOAD_SIZE, maxPayload);
+    seqModulus = windowSize > 1 ? LL_SEQ_MODULUS : 2;
+    windowBase = nextSeq = 0;
+    expectedSeq = nextDeliver = 0;
+    rejSent = FALSE;
+    ackPending = FALSE;
+    memset(rxWindow, 0, sizeof(rxWindow));
+    printf("Window size: %d (%s)\n", windowSize,
+           windowSize == 1 ? "stop-and-wait" : arqMode == ArqSelectiveRepeat ? "selective repeat" : "go-back-N");
+    printf("Frame check: %s\n", frameCheckNames[frameCheck]);
+    printf("Maximum payload: %d bytes\n", maxPayload);
+    if (fecMode == FecReedSolomon) {
+        printf("Forward error correction: RS(%d,%d)\n", RS_CODEWORD_SIZE, RS_DATA_SIZE);
+    }
+    if (duplex) {
+        printf("Full duplex\n");
+    }
+    if (channels > 1) {
+        printf("Logical channels: %d\n", channels);
+    }
+}
+
+// Time the serial port takes to send size bytes (8-N-1, 10 bits per byte), in usec
+long long frameTimeUs(int size) {
+    return (long long)size * 10 * 1000000 / parameters.baudRate;
+}
+
+// Accounts for size bytes written to the serial port, which are sent after
+// everything written before them. Returns the time the last byte will be sent.
+long long queueTxBytes(long long now, int size) {
+    if (txIdleAt < now) {
+        txIdleAt = now;
+    }
+    txIdleAt += frameTimeUs(size);
+    return txIdleAt;
+}
+
+// Function of the TX to send the SET frame and receive the UA frame
+int transmitterSETframe() {
+    unsigned char params[MAX_PARAMS_SIZE];
+    unsigned char frame[MAX_OPEN_FRAME_SIZE];
+    LinkLayerOptions proposal = proposedOptions;
+    proposal.windowSize = limitWindow(proposal.windowSize, proposal.arqMode);
+    proposal.maxPayload = limitPayload(proposal.maxPayload);
+    int paramsSize = writeParameters(params, &proposal);
+    struct iovec iov = {.iov_base = params, .iov_len = paramsSize};
+    int frameSize = buildFrame(frame, A_TRANS, C_SET, &iov, 1, FrameCheckBcc2, FecNone);
+    printf("Sending SENT frame\n");
+
+    memset(&receiver, 0, sizeof(receiver));
+    for (int attempt = 0; attempt < parameters.nRetransmissions; attempt++) {
+        int bytesSent = writePort(frame, frameSize);
+        printf("Written bytes on frame: %d\n", bytesSent);
+        if (bytesSent != frameSize) {
+            perror("Error writing frame");
+            return -1;
+        }
+
+        Timer timer;
+        long long sentAt = queueTxBytes(timerNow(), frameSize);
+        timerStart(&timer, timeoutUs);
+        int result;
+
+        while ((result = waitFrame(&timer)) == 1) {
+            int seq;
+            if (decodeControl(receiver.control, &seq) != FRAME_UA) {
+                continue;
+            }
             printf("UA frame received\n");
+
+            // The SET/UA exchange gives the first round trip time sample
+            if (attempt == 0) {
+                rttSample(&rtt, timerNow() - sentAt);
+            }
+
+            // A UA without parameters comes from a peer that does not negotiate
+            LinkLayerOptions agreed = {1, ArqGoBackN, FrameCheckBcc2, MAX_PAYLOAD_SIZE, FecNone, FALSE, 1};
+            if (checkFrame(&receiver, FrameCheckBcc2)) {
+                readParameters(receiver.data, receiver.size, &agreed);
+            }
+            setOptions(&agreed);
             return 1;
         }
+
+        if (result < 0) {
+            return -1;
+        }
+        printf("Couldnt receive frame\n");
     }
 
     return -1;
@@ -153,21 +913,49 @@ int transmitterSETframe() {
 
 // Function of the RX to receive the SET frame and send the UA frame
 int receiverSETframe() {
-    while (TRUE) {
-        unsigned char byteFrame = 0;
-
-        int byteRead = read(fd, &byteFrame, 1);
+    memset(&receiver, 0, sizeof(receiver));
 
-        if (byteRead != 0) {
-            handleState(byteFrame);
+    while (TRUE) {
+        if (waitFrame(NULL) < 0) {
+            return -1;
         }
 
-        if (state == STOP_STATE) {
-            unsigned char sendFrame[5] = {FLAG, A_TRANS, C_UA, A_TRANS ^ C_UA, FLAG};
-
-            handleState(byteFrame);
+        int seq;
+        if (decodeControl(receiver.control, &seq) == FRAME_SET) {
+            printf("Frame received!\n");
+
+            // A SET without parameters comes from a peer that does not negotiate
+            LinkLayerOptions agreed = {1, ArqGoBackN, FrameCheckBcc2, MAX_PAYLOAD_SIZE, FecNone, FALSE, 1};
+            if (checkFrame(&receiver, FrameCheckBcc2)) {
+                unsigned char params[MAX_PARAMS_SIZE];
+                readParameters(receiver.data, receiver.size, &agreed);
+                if (agreed.windowSize > proposedOptions.windowSize) {
+                    agreed.windowSize = proposedOptions.windowSize;
+                }
+                if (agreed.frameCheck < proposedOptions.frameCheck) {
+                    agreed.frameCheck = proposedOptions.frameCheck;
+                }
+                if (agreed.maxPayload > proposedOptions.maxPayload) {
+                    agreed.maxPayload = proposedOptions.maxPayload;
+                }
+                if (agreed.channels > proposedOptions.channels) {
+                    agreed.channels = proposedOptions.channels;
+                }
+                agreed.duplex = agreed.duplex && proposedOptions.duplex;
+                setOptions(&agreed);
+                LinkLayerOptions echoed;
+                llgetoptions(&echoed);
+                int paramsSize = writeParameters(params, &echoed);
+                struct iovec iov = {.iov_base = params, .iov_len = paramsSize};
+                uaFrameSize = buildFrame(uaFrame, A_TRANS, C_UA, &iov, 1, FrameCheckBcc2, FecNone);
+            } else {
+                setOptions(&agreed);
+                unsigned char plainUA[5] = {FLAG, A_TRANS, C_UA, A_TRANS ^ C_UA, FLAG};
+                memcpy(uaFrame, plainUA, 5);
+                uaFrameSize = 5;
+            }
 
-            int writeBytes = write(fd, sendFrame, 5);
+            int writeBytes = writePort(uaFrame, uaFrameSize);
             printf("Bytes written: %d\n", writeBytes);
 
             return 1;
@@ -181,15 +969,20 @@ int receiverSETframe() {
 // LLOPEN
 ////////////////////////////////////////////////
 // Create connection between Tx and Rx
-int llopen(LinkLayer connectionParameters)
+int openConnection(LinkLayer connectionParameters)
 {
     parameters = connectionParameters;
     fd = openSerialPort(connectionParameters.serialPort, connectionParameters.baudRate);
 
-    if (fd < 0) {
+    if (fd < 0 || vclockOpen(connectionParameters.role == LlTx ? VCLOCK_TX : VCLOCK_RX) != 0) {
         return -1;
     }
-    gettimeofday(&start_time, NULL);
+    rxBufferPos = rxBufferSize = 0;
+    peerOpenDataSize = 0;
+    timeoutUs = (long long)connectionParameters.timeout * 1000000;
+    rttInit(&rtt, timeoutUs);
+    txIdleAt = 0;
+    startTime = timerNow();
     switch (connectionParameters.role)
     {
     case LlTx:
@@ -209,245 +1002,744 @@ int llopen(LinkLayer connectionParameters)
     return 1;
 }
 
+int llopen(LinkLayer connectionParameters)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&linkChanged, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_mutex_lock(&linkLock);
+    int result = openConnection(connectionParameters);
+    pthread_mutex_unlock(&linkLock);
+    return result;
+}
+
+// A resent I frame must carry the current acknowledgement, since an old one could
+// acknowledge frames the peer never received once the sequence numbers wrap around.
+// The acknowledgement is never stuffed, so it is the byte after the header; if it
+// changed, the frame is destuffed and built again.
+void refreshAck(TxSlot *slot, int seq) {
+    static unsigned char field[MAX_FIELD_SIZE];
+
+    ackPending = FALSE;
+    if (slot->frame[4] == expectedSeq) {
+        return;
+    }
+
+    int fieldSize = 0;
+    unsigned char unused = 0;
+    destuffBytes(field, sizeof(field), &fieldSize, &slot->frame[4], slot->size - 5, &unused);
+    field[0] = expectedSeq;
+    struct iovec iov = {.iov_base = field, .iov_len = slot->fieldSize};
+    slot->size = buildFrame(slot->frame, txAddress, controlI(seq), &iov, 1, frameCheck, fecMode);
+}
+
+// Sends (or resends) the I frame with sequence number seq and restarts its timer.
+// The timer covers the estimated round trip after the frame actually leaves the
+// serial port, which may be after other frames still queued for transmission.
+int sendWindowFrame(int seq) {
+    TxSlot *slot = &txWindow[seq];
+    waitWriter();
+    if (duplex && slot->sends > 0) {
+        refreshAck(slot, seq);
+    }
+
+    int frameSize = slot->size;
+    int bytesSent = writeSerial(slot->frame, frameSize);
+    if (verbose) {
+        printf("Written bytes on frame %d: %d\n", seq, bytesSent);
+    }
+    totalFramesSent++;
+
+    if (bytesSent != frameSize) {
+        perror("Error writing frame");
+        return -1;
+    }
+
+    long long now = timerNow();
+    sizerSent(&sizer, frameSize);
+    slot->sentAt = queueTxBytes(now, frameSize);
+    if (slot->sends++ == 0) {
+        slot->firstSentAt = now;
+    }
+    timerStart(&slot->timer, slot->sentAt - now + rtt.rto);
+    return 0;
+}
+
+// Resends every frame from seq up to the last one sent (go-back-N)
+int resendFrom(int seq) {
+    for (int s = seq; s != nextSeq; s = (s + 1) % seqModulus) {
+        retransmissions++;
+        if (sendWindowFrame(s) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Queues the completion of an asynchronous write for llpoll to report
+void completeWrite(TxSlot *slot, int result) {
+    if (slot->done != NULL) {
+        completions[completionCount++] = (Completion){slot->done, slot->context, result};
+        slot->done = NULL;
+    }
+}
+
+// Updates the transmitter window with a received RR/REJ/SREJ
+int handleResponse(FrameType type, int seq) {
+    int outstanding = seqDistance(windowBase, nextSeq);
+    int acked = seqDistance(windowBase, seq);
+
+    // Stop-and-wait peers may send REJ with either sequence number
+    if (type == FRAME_REJ && seqModulus == 2) {
+        printf("Info frame rejected!\n");
+        sizerError(&sizer);
+        return resendFrom(windowBase);
+    }
+
+    if (type == FRAME_SREJ) {
+        if (acked < outstanding) {
+            printf("Info frame %d selectively rejected!\n", seq);
+            sizerError(&sizer);
+            retransmissions++;
+            if (sendWindowFrame(seq) != 0) {
+                return -1;
+            }
+
+            // Later frames may be waiting in the receiver for this one, so they
+            // cannot be acknowledged before it arrives
+            long long now = timerNow();
+            for (int s = (seq + 1) % seqModulus; s != nextSeq; s = (s + 1) % seqModulus) {
+                long long sentAt = txWindow[s].sentAt > txWindow[seq].sentAt ? txWindow[s].sentAt : txWindow[seq].sentAt;
+                timerStart(&txWindow[s].timer, sentAt - now + rtt.rto);
+            }
+        }
+        return 0;
+    }
+
+    // RR and REJ acknowledge every frame before seq
+    if ((type != FRAME_RR && type != FRAME_REJ) || acked > outstanding) {
+        return 0;
+    }
+
+    if (acked > 0) {
+        if (verbose) {
+            printf("Info frame received\n");
+        }
+
+        // The acknowledgement was triggered by the last frame it covers, unless it was
+        // held back by a retransmitted frame. Retransmissions give ambiguous samples
+        // (Karn's algorithm).
+        TxSlot *last = &txWindow[(seq - 1 + seqModulus) % seqModulus];
+        long long now = timerNow();
+        int retransmitted = FALSE;
+        for (int s = windowBase; s != seq; s = (s + 1) % seqModulus) {
+            retransmitted |= txWindow[s].sends > 1;
+        }
+        if (!retransmitted) {
+            rttSample(&rtt, now - last->sentAt);
+
+            // An early acknowledgement means the serial port drained faster than estimated
+            if (last->sentAt > now) {
+                txIdleAt -= last->sentAt - now;
+            }
+        }
+
+        for (; windowBase != seq; windowBase = (windowBase + 1) % seqModulus) {
+            timerStop(&txWindow[windowBase].timer);
+            completeWrite(&txWindow[windowBase], txWindow[windowBase].size);
+        }
+    }
+
+    if (type == FRAME_REJ && windowBase != nextSeq) {
+        printf("Info frame rejected!\n");
+        sizerError(&sizer);
+        return resendFrom(windowBase);
+    }
+    return 0;
+}
+
+// Retransmits the frames whose timer expired, backing off the timeout.
+// Go-back-N resends everything from the expired frame, selective repeat only that frame.
+// Since the adaptive timeout can be much shorter than the configured one, a frame only
+// fails after nRetransmissions timeouts spanning at least nRetransmissions * timeout.
+// Returns -1 if a frame ran out of retransmissions.
+int handleTimeouts(long long now) {
+    int backedOff = FALSE;
+
+    for (int s = windowBase; s != nextSeq; s = (s + 1) % seqModulus) {
+        TxSlot *slot = &txWindow[s];
+        if (!timerExpired(&slot->timer, now)) {
+            continue;
+        }
+
+        if (verbose) {
+            printf("Couldnt receive frame %d\n", s);
+        }
+        sizerError(&sizer);
+        if (++slot->timeouts >= parameters.nRetransmissions &&
+            now - slot->firstSentAt >= parameters.nRetransmissions * timeoutUs) {
+            return -1;
+        }
+
+        if (!backedOff) {
+            rttBackoff(&rtt);
+            backedOff = TRUE;
+        }
+
+        if (arqMode == ArqGoBackN) {
+            return resendFrom(s);
+        }
+        retransmissions++;
+        if (sendWindowFrame(s) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void handleIFrame(int seq);
+
+// Sends the RR owed for the received I frames, unless an I frame already carried it.
+// While another thread is writing, the RR is left for it to send when done.
+void sendPendingAck() {
+    if (!ackPending || writing) {
+        return;
+    }
+    ackPending = FALSE;
+
+    unsigned char control_response = controlRR(expectedSeq);
+    unsigned char response[5] = {FLAG, rxAddress, control_response, rxAddress ^ control_response, FLAG};
+    int writtenBytes = writeSerial(response, 5);
+    if (verbose) {
+        printf("Written bytes on response: %d\n", writtenBytes);
+    }
+}
+
+// Handles a received frame: I frames of the peer, responses to our I frames, and a SET
+// repeated because the UA was lost
+int handleFrame() {
+    int seq;
+    FrameType type = decodeControl(receiver.control, &seq);
+
+    if (type == FRAME_I && receiver.address == rxAddress) {
+        handleIFrame(seq);
+    } else if (type == FRAME_SET && parameters.role == LlRx) {
+        writeSerial(uaFrame, uaFrameSize);
+    } else if (receiver.address == txAddress && type != FRAME_I) {
+        return handleResponse(type, seq);
+    }
+    return 0;
+}
+
+// Handles the frames arriving and the expired timers of our I frames, waiting at most
+// until the earliest timer expires or maxWaitMs (-1 for no limit). The RR owed is sent
+// before waiting.
+// Returns 0, or -1 on error or if a frame ran out of retransmissions.
+int serviceLink(int maxWaitMs) {
+    long long now = timerNow();
+    if (handleTimeouts(now) != 0) {
+        return -1;
+    }
+
+    int waitMs = -1;
+    for (int s = windowBase; s != nextSeq; s = (s + 1) % seqModulus) {
+        waitMs = timerMinTimeout(waitMs, timerPollTimeout(&txWindow[s].timer, now));
+    }
+    waitMs = timerMinTimeout(waitMs, maxWaitMs);
+
+    if (rxBufferPos == rxBufferSize) {
+        sendPendingAck();
+    }
+
+    int result = readFrame(&receiver, waitMs);
+    if (result < 0) {
+        return -1;
+    }
+    return result == 1 ? handleFrame() : 0;
+}
+
+// Processes responses and timeouts until at most maxOutstanding frames are unacknowledged.
+// Sleeps in poll until a response arrives or the earliest frame timer expires.
+int flushWindow(int maxOutstanding) {
+    while (seqDistance(windowBase, nextSeq) > maxOutstanding) {
+        if (serviceLink(-1) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Besides framing and the frame check, every frame costs its acknowledgement and,
+// in stop-and-wait, the line stays idle for the round trip.
+int llsuggestpayload() {
+    pthread_mutex_lock(&linkLock);
+    double overhead = 5 + checkSize(frameCheck) + 5;
+    if (windowSize == 1 && rtt.samples > 0) {
+        overhead += rtt.srtt * parameters.baudRate / 10e6;
+    }
+
+    int payload = sizerSuggest(&sizer, overhead);
+    pthread_mutex_unlock(&linkLock);
+    return payload;
+}
+
+void llrecordpayload(int payload) {
+    pthread_mutex_lock(&linkLock);
+    sizerRecord(&sizer, payload);
+    pthread_mutex_unlock(&linkLock);
+}
+
 ////////////////////////////////////////////////
 // LLWRITE
 ////////////////////////////////////////////////
 // Creates the frame whose data is in the buf
 // Starts by adding the header of the frame and then adds the buf's data into the frame using byte stuffing;
-// After that, adds the BBC2 and FLAG to the final of the frame. Finally, sends the frame to the receiver and waits for the response
+// After that, adds the frame check (BCC2 or CRC) and FLAG to the final of the frame. Finally, sends the frame and keeps it
+// in the window, waiting for responses only while the window is full
 int llwrite(const unsigned char *buf, int bufSize)
 {
-    printf("Writting bytes...\n");
+    if (bufSize < 0) {
+        printf("Invalid frame size: %d bytes\n", bufSize);
+        return -1;
+    }
 
-    unsigned char iframe[bufSize*2], bcc2 = 0;
-    int idx = 0;
+    struct iovec iov = {.iov_base = (unsigned char *)buf, .iov_len = bufSize};
+    return llwritev(&iov, 1);
+}
 
-    // Frame's header
-    iframe[idx] = FLAG; idx++;
-    iframe[idx] = A_TRANS; idx++;
-    iframe[idx] = currSeq ? C_I1 : C_I0; idx++;
-    iframe[idx] = A_TRANS ^ iframe[idx-1]; idx++;
-
-    // Adds buf's data into the frame
-    for (int i = 0; i < bufSize; i++) {
-        unsigned char currByte = buf[i];
-
-        switch (currByte) {
-            case ESCAPE:
-                iframe[idx] = ESCAPE; idx++;
-                iframe[idx] = ESCAPE ^ 0x20; idx++;
-                break;
-            case FLAG:
-                iframe[idx] = ESCAPE; idx++;
-                iframe[idx] = FLAG ^ 0x20; idx++;
-                break;
-            default:
-                iframe[idx] = currByte; idx++;
-                break;
+// Whether a writer of channel may take the window: no writer of a more urgent channel waits
+int writerTurn(int channel) {
+    for (int c = 0; c < channels; c++) {
+        if (waitingWriters[c] > 0 && channelPriority[c] > channelPriority[channel]) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Waits until the window has room for a frame of channel, its writer is the most
+// urgent one waiting and no frame is being written. Returns 0, or -1 on error.
+int waitWindow(int channel) {
+    int result = 0;
+
+    waitingWriters[channel]++;
+    while (seqDistance(windowBase, nextSeq) >= windowSize || !writerTurn(channel) || writing) {
+        if (!writerTurn(channel) || writing) {
+            pthread_cond_wait(&linkChanged, &linkLock);
+        } else if ((result = serviceLink(-1)) != 0) {
+            break;
         }
+    }
+    waitingWriters[channel]--;
+    pthread_cond_broadcast(&linkChanged);
+    return result;
+}
+
+// Checks that a packet can be written on channel.
+// Returns its size, or -1 if it cannot.
+int checkPacket(int channel, const struct iovec *iov, int iovcnt)
+{
+    size_t bufSize = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        bufSize += iov[i].iov_len;
+    }
+
+    if (bufSize > (size_t)maxPayload + LL_PACKET_HEADER_SIZE) {
+        printf("Frame too large: %zu bytes\n", bufSize);
+        return -1;
+    }
+
+    if (channel < 0 || channel >= channels) {
+        printf("Invalid channel: %d\n", channel);
+        return -1;
+    }
+    return bufSize;
+}
+
+// Builds the I frame of a packet in the next slot of the window, which must have room,
+// and sends it. done is called with the result once the frame is acknowledged.
+// The buffers are stuffed straight into the frame kept in the window, which is
+// both the only copy of the data and what is written to the serial port.
+// In full duplex the frame starts with the acknowledgement of the received I frames,
+// followed by the channel if several are multiplexed.
+// Returns the size of the frame, or -1 on error.
+int queueFrame(int channel, const struct iovec *iov, int iovcnt, int bufSize, LlWriteCallback done, void *context)
+{
+    unsigned char header[ACK_SIZE + CHANNEL_SIZE];
+    int headerSize = 0;
+    if (duplex) {
+        header[headerSize++] = expectedSeq;
+        ackPending = FALSE;
+    }
+    if (channels > 1) {
+        header[headerSize++] = channel;
+    }
 
-        bcc2 ^= currByte;
+    struct iovec field[iovcnt + 1];
+    field[0].iov_base = header;
+    field[0].iov_len = headerSize;
+    memcpy(&field[1], iov, iovcnt * sizeof(struct iovec));
+
+    int seq = nextSeq;
+    TxSlot *slot = &txWindow[seq];
+    slot->size = buildFrame(slot->frame, txAddress, controlI(seq), field, iovcnt + 1, frameCheck, fecMode);
+    slot->fieldSize = headerSize + bufSize;
+    slot->timeouts = 0;
+    slot->sends = 0;
+    slot->done = done;
+    slot->context = context;
+    nextSeq = (nextSeq + 1) % seqModulus;
+
+    if (sendWindowFrame(seq) != 0) {
+        slot->done = NULL;
+        return -1;
     }
-    
-    iframe[idx] = bcc2;
 
-    if (bcc2 == FLAG) {
-        iframe[idx] = ESCAPE; idx++;
-        iframe[idx] = FLAG ^ 0x20;
-    } else if (bcc2 == ESCAPE) {
-        iframe[idx] = ESCAPE; idx++;
-        iframe[idx] = ESCAPE ^ 0x20;
+    return slot->size;
+}
+
+int writeFrame(int channel, const struct iovec *iov, int iovcnt)
+{
+    if (verbose) {
+        printf("Writting bytes...\n");
     }
-    idx++;
 
-    iframe[idx] = FLAG;
+    int bufSize = checkPacket(channel, iov, iovcnt);
+    if (bufSize < 0 || waitWindow(channel) != 0) {
+        return -1;
+    }
+    return queueFrame(channel, iov, iovcnt, bufSize, NULL, NULL);
+}
 
-    alarmCount = 0;
-    int bytesSent = 0;
-    waitAlarm = FALSE;
-    state = START;
-    unsigned char response = 0;
+int llwritev(const struct iovec *iov, int iovcnt)
+{
+    return llwritech(LL_DEFAULT_CHANNEL, iov, iovcnt);
+}
 
-    // Sends frame and wait for answer
-    //If response not received, resends the frame
-    //If rejected, resend the frame without retransmission update
-    while (alarmCount < parameters.nRetransmissions) {
+int llwritech(int channel, const struct iovec *iov, int iovcnt)
+{
+    pthread_mutex_lock(&linkLock);
+    int result = writeFrame(channel, iov, iovcnt);
+    pthread_mutex_unlock(&linkLock);
+    return result;
+}
 
-        if (!waitAlarm) {
-            retransmissions += alarmCount > 1 ? 1 : 0;
-            totalFramesSent++;
-            bytesSent = write(fd, iframe, idx+1);
-            printf("Written bytes on frame: %d\n", bytesSent);
-            
-            alarmInit();
-            state = START;
+// Answers an I frame according to the receiver window. The window starts at the first
+// frame not delivered by llread yet, which only lags in full duplex.
+void handleIFrame(int seq) {
+    int offset = seqDistance(expectedSeq, seq);
+
+    // Frames outside the window are duplicates whose RR was lost, or frames llread
+    // has no room for yet
+    if (offset >= windowSize - seqDistance(nextDeliver, expectedSeq)) {
+        if (seqDistance(seq, expectedSeq) <= windowSize) {
+            sendSupervision(rxAddress, controlRR(expectedSeq));
         }
+        return;
+    }
 
-        int bytesResponse = read(fd, &response, 1);
+    if (!checkIFrame(&receiver)) {
+        printf("Wrong frame check!\n");
+        if (arqMode == ArqSelectiveRepeat && windowSize > 1) {
+            rxWindow[seq].srejSent = TRUE;
+            sendSupervision(rxAddress, C_WIN_SREJ | (seq << 4));
+        } else if (!rejSent || offset == 0) {
+            // A damaged retransmission of the expected frame is rejected again
+            rejSent = TRUE;
+            sendSupervision(rxAddress, controlREJ(expectedSeq));
+        }
+        return;
+    }
 
-        if (bytesResponse > 0) {
-            printf("%02X ", response);
-            handleState(response);
+    // Go-back-N discards frames after a gap
+    if (offset > 0 && (arqMode == ArqGoBackN || windowSize == 1)) {
+        if (!rejSent) {
+            rejSent = TRUE;
+            sendSupervision(rxAddress, controlREJ(expectedSeq));
         }
+        return;
+    }
 
-        if (state == STOP_STATE) {
+    // The acknowledgement carried in full duplex counts as an RR of our I frames
+    int headerSize = 0;
+    if (duplex && receiver.size > headerSize) {
+        handleResponse(FRAME_RR, receiver.data[headerSize] % seqModulus);
+        headerSize += ACK_SIZE;
+    }
+    int channel = 0;
+    if (channels > 1 && receiver.size > headerSize) {
+        channel = receiver.data[headerSize] % channels;
+        headerSize += CHANNEL_SIZE;
+    }
 
-            // Info frame received
-            if (control_flag == (currSeq? C_RR0 : C_RR1)) {
-                alarm(0);
-                printf("Info frame received\n");
-                currSeq = 1 - currSeq;
-                return idx;
-            }
+    RxSlot *slot = &rxWindow[seq];
+    if (!slot->valid) {
+        memcpy(slot->data, &receiver.data[headerSize], receiver.size - headerSize);
+        slot->size = receiver.size - headerSize;
+        slot->channel = channel;
+        slot->valid = TRUE;
+        totalFramesReceived++;
+    }
 
-            // Info frame rejected
-            if (control_flag == C_REJ0 || control_flag == C_REJ1) {
-                alarm(0);
-                waitAlarm = FALSE;
-                printf("Info frame rejected!\n");
+    if (offset > 0) {
+        // Selective repeat: ask for every missing frame before this one
+        for (int s = expectedSeq; s != seq; s = (s + 1) % seqModulus) {
+            if (!rxWindow[s].valid && !rxWindow[s].srejSent) {
+                rxWindow[s].srejSent = TRUE;
+                sendSupervision(rxAddress, C_WIN_SREJ | (s << 4));
             }
         }
+        return;
     }
 
-    return -1;
+    while (rxWindow[expectedSeq].valid) {
+        rxWindow[expectedSeq].srejSent = FALSE;
+        expectedSeq = (expectedSeq + 1) % seqModulus;
+    }
+    rejSent = FALSE;
+
+    // In full duplex the RR may ride on the next I frame
+    ackPending = TRUE;
+    if (!duplex) {
+        sendPendingAck();
+    }
 }
 
 ////////////////////////////////////////////////
 // LLREAD
 ////////////////////////////////////////////////
 // Using a state machine fills the packet with the important data (using byte destuffing)
-// After that, checks if the frame's BBC2 matches with the calculation
-// If BBC2 correct, sends an answer to the Tx. If not, rejects the frame.
+// After that, checks if the frame's check (BCC2 or CRC) matches with the calculation
+// If correct, sends an answer to the Tx. If not, rejects the frame.
+// Frames are delivered in order; out of order frames wait in the receiver window.
+// Stores and returns at most MAX_PAYLOAD_SIZE bytes, the size of the buffers of
+// link_layer.h, unless llsetoptions was called: then at most the negotiated
+// maxPayload + LL_PACKET_HEADER_SIZE.
 int llread(unsigned char *packet)
 {
-    State state_read = START;
-    unsigned char control_byte = 0, byte = 0;
-    int idx = 0; 
-
-    // Reads one byte at a time. Adds data to the packet
-    while (state_read != STOP_STATE) {
-        int byteRead = read(fd, &byte, 1);
-
-        if (byteRead > 0) {
-            switch (state_read) {
-                case START:
-                    if (byte == FLAG) {
-                        state_read = FLAG_RCV;
-                    } else {
-                        state_read = START;
-                    }
-                    break;
-                case FLAG_RCV:
-                    if (byte == A_TRANS) {
-                        state_read = A_RCV;
-                    } else if (byte != FLAG) {
-                        state_read = START;
-                    }
-                    break;
-                case A_RCV:
-                    if (byte == C_I0 || byte == C_I1) {
-                        control_byte = byte;
-                        state_read = C_RCV;
-                    } else if (byte == FLAG) {
-                        state_read = FLAG_RCV;
-                    } else {
-                        state_read = START;
-                    }
-                    break;
-                case C_RCV:
-                    if (byte == (A_TRANS ^ control_byte)) {
-                        state_read = BCC_OK;
-                    } else if (byte == FLAG) {
-                        state_read = FLAG_RCV;
-                    } else {
-                        state_read = START;
-                    }
-                    break;
-                case BCC_OK:
-                    if (byte == FLAG) {
-                        state_read = STOP_STATE;
-                    } else if (byte == ESCAPE) {
-                        state_read = ESCAPE_STATE;
-                    } else {
-                        packet[idx] = byte; idx++;
-                        state_read = DATA;
-                    }
-                    break;
-                case DATA:
-                    if (byte == ESCAPE) {
-                        state_read = ESCAPE_STATE;
-                    } else if (byte == FLAG) {
-                        state_read = STOP_STATE;
-                    } else {
-                        packet[idx] = byte; idx++;
-                    }
-                    break;
-                case ESCAPE_STATE:
-                    if (byte == (FLAG ^ 0x20)) {
-                        state_read = DATA;
-                        packet[idx] = FLAG; idx++;
-                    } else if (byte == (ESCAPE ^ 0x20)) {
-                        state_read = DATA;
-                        packet[idx] = ESCAPE; idx++;
-                    } else {
-                        state_read = START;
-                    }
-                    break;
-                case STOP_STATE:
-                    break;
-                default:
-                    break;
-            }   
+    struct iovec iov = {.iov_base = packet,
+                        .iov_len = optionsSet ? maxPayload + LL_PACKET_HEADER_SIZE : MAX_PAYLOAD_SIZE};
+    int size = llreadv(&iov, 1);
+    return size > (int)iov.iov_len ? (int)iov.iov_len : size;
+}
+
+// First frame of channel received in order and not delivered yet, -1 if none
+int findPacket(int channel) {
+    for (int s = nextDeliver; s != expectedSeq; s = (s + 1) % seqModulus) {
+        if (rxWindow[s].valid && rxWindow[s].channel == channel) {
+            return s;
         }
     }
+    return -1;
+}
 
-    // Calculate BBC2
-    unsigned char bcc2 = 0;
-    for (int i = 0; i < idx-1; i++) {
-        bcc2 ^= packet[i];
+// Whether another thread reads a channel holding frames in the receiver window, so
+// waiting for it to make room cannot block the calling thread forever
+int otherReader() {
+    pthread_t self = pthread_self();
+    for (int s = nextDeliver; s != expectedSeq; s = (s + 1) % seqModulus) {
+        int channel = rxWindow[s].channel;
+        if (!rxWindow[s].valid) {
+            continue;
+        }
+        if (readCallbacks[channel] != NULL ? polled && !pthread_equal(pollThread, self)
+                                           : channelRead[channel] && !pthread_equal(channelReaders[channel], self)) {
+            return TRUE;
+        }
     }
+    return FALSE;
+}
 
-    unsigned char control_response = 0;
+int takePacket(int seq, const struct iovec *iov, int iovcnt);
 
-    // Reject frame
-    if (bcc2 != packet[idx-1]) {
-        printf("Wrong bcc2!\n");
+// Frames of other channels are left for their readers; the window only moves past a
+// frame once it is delivered. While those fill the window, frames are left unread in
+// the serial port rather than discarded, until their readers make room. If no other
+// thread reads them, fails with EAGAIN instead of waiting forever.
+int readPacket(int channel, const struct iovec *iov, int iovcnt)
+{
+    if (channel < 0 || channel >= channels) {
+        printf("Invalid channel: %d\n", channel);
+        return -1;
+    }
+    channelReaders[channel] = pthread_self();
+    channelRead[channel] = TRUE;
+
+    int seq;
+    while ((seq = findPacket(channel)) < 0) {
+        if (seqDistance(nextDeliver, expectedSeq) >= windowSize) {
+            if (!otherReader()) {
+                errno = EAGAIN;
+                return -1;
+            }
+            pthread_cond_wait(&linkChanged, &linkLock);
+        } else if (serviceLink(-1) != 0) {
+            return -1;
+        }
+    }
 
-        control_response = currSeq ? C_REJ0 : C_REJ1;
+    return takePacket(seq, iov, iovcnt);
+}
 
-        unsigned char response[5] = {FLAG, A_TRANS, control_response, A_TRANS ^ control_response, FLAG};
-        write(fd, response, 5);
-        return -1;
+// Delivers the frame in slot seq of the receiver window, scattering it over iov.
+// Returns the size of the packet.
+int takePacket(int seq, const struct iovec *iov, int iovcnt)
+{
+    RxSlot *slot = &rxWindow[seq];
+    int size = slot->size;
+    int copied = 0;
+    for (int i = 0; i < iovcnt && copied < size; i++) {
+        int length = iov[i].iov_len < (size_t)(size - copied) ? (int)iov[i].iov_len : size - copied;
+        memcpy(iov[i].iov_base, &slot->data[copied], length);
+        copied += length;
+    }
+    slot->valid = FALSE;
+    while (nextDeliver != expectedSeq && !rxWindow[nextDeliver].valid) {
+        nextDeliver = (nextDeliver + 1) % seqModulus;
     }
+    pthread_cond_broadcast(&linkChanged);
+    totalDataBytes += size;
+    return size;
+}
 
-    // Send answer
-    control_response = currSeq ? C_RR0 : C_RR1;
-    unsigned char response[5] = {FLAG, A_TRANS, control_response, A_TRANS ^ control_response, FLAG};
-    int writtenBytes = write(fd, response, 5);
-    printf("Written bytes on response: %d\n", writtenBytes);
-    totalFramesReceived++;
-    totalDataBytes += idx;
-    currSeq = 1 - currSeq;
-    return idx;
+int llwriteasync(int channel, const struct iovec *iov, int iovcnt, LlWriteCallback done, void *context)
+{
+    pthread_mutex_lock(&linkLock);
+    int result = checkPacket(channel, iov, iovcnt);
+    if (result >= 0) {
+        if (seqDistance(windowBase, nextSeq) >= windowSize || !writerTurn(channel) || writing ||
+            asyncWrites >= LL_SEQ_MODULUS) {
+            result = 0;
+        } else if ((result = queueFrame(channel, iov, iovcnt, result, done, context)) > 0 && done != NULL) {
+            asyncWrites++;
+        }
+    }
+    pthread_mutex_unlock(&linkLock);
+    return result;
+}
+
+void llsetreadcallback(int channel, LlReadCallback callback, void *context)
+{
+    if (channel >= 0 && channel < LL_MAX_CHANNELS) {
+        pthread_mutex_lock(&linkLock);
+        readCallbacks[channel] = callback;
+        readContexts[channel] = context;
+        pthread_mutex_unlock(&linkLock);
+    }
+}
+
+int llpending()
+{
+    pthread_mutex_lock(&linkLock);
+    int pending = asyncWrites;
+    pthread_mutex_unlock(&linkLock);
+    return pending;
+}
+
+// Callbacks run without linkLock, so they may submit writes and poll again
+int llpoll(int timeoutMs)
+{
+    pthread_mutex_lock(&linkLock);
+    pollThread = pthread_self();
+    polled = TRUE;
+    int result = serviceLink(timeoutMs);
+    while (result == 0 && rxBufferPos < rxBufferSize) {
+        result = serviceLink(0);
+    }
+    if (result != 0) {
+        // A broken link fails the writes still waiting for an acknowledgement
+        for (int s = windowBase; s != nextSeq; s = (s + 1) % seqModulus) {
+            completeWrite(&txWindow[s], -1);
+        }
+    }
+
+    Completion done[LL_SEQ_MODULUS];
+    int count = completionCount;
+    memcpy(done, completions, count * sizeof(Completion));
+    completionCount = 0;
+    asyncWrites -= count;
+    pthread_mutex_unlock(&linkLock);
+
+    for (int i = 0; i < count; i++) {
+        done[i].done(done[i].context, done[i].result);
+    }
+
+    unsigned char packet[MAX_INFO_SIZE];
+    struct iovec iov = {.iov_base = packet, .iov_len = sizeof(packet)};
+    for (int channel = 0; channel < LL_MAX_CHANNELS; channel++) {
+        while (TRUE) {
+            pthread_mutex_lock(&linkLock);
+            LlReadCallback callback = readCallbacks[channel];
+            void *context = readContexts[channel];
+            int seq = callback != NULL ? findPacket(channel) : -1;
+            int size = seq >= 0 ? takePacket(seq, &iov, 1) : 0;
+            pthread_mutex_unlock(&linkLock);
+            if (seq < 0) {
+                break;
+            }
+            callback(context, channel, packet, size);
+            count++;
+        }
+    }
+
+    return result != 0 ? -1 : count;
+}
+
+int llreadv(const struct iovec *iov, int iovcnt)
+{
+    return llreadch(LL_DEFAULT_CHANNEL, iov, iovcnt);
+}
+
+int llreadch(int channel, const struct iovec *iov, int iovcnt)
+{
+    pthread_mutex_lock(&linkLock);
+    int result = readPacket(channel, iov, iovcnt);
+    pthread_mutex_unlock(&linkLock);
+    return result;
+}
+
+// Waits for a frame with the given address and control until the timer expires (forever
+// if timer is NULL), answering I frames that are retransmitted because their RR was lost.
+// Returns 1 if received, 0 on timeout, -1 on error.
+int waitControlFrame(unsigned char address, unsigned char control, const Timer *timer) {
+    int result;
+
+    while ((result = waitFrame(timer)) == 1) {
+        int seq;
+        if (receiver.address == address && receiver.control == control) {
+            return 1;
+        }
+        if (receiver.address == rxAddress && decodeControl(receiver.control, &seq) == FRAME_I) {
+            sendSupervision(rxAddress, controlRR(expectedSeq));
+        }
+    }
+    return result;
 }
 
 ////////////////////////////////////////////////
 // LLCLOSE
 ////////////////////////////////////////////////
-// Tx tries to send the DISC frame and receive another DISC
-// If DISC was successful, Tx sends UA frame
-int llclose(int showStatistics) {
-    state = START;
-    unsigned char byte;
+// Tx waits for every frame in the window to be acknowledged, then tries to send the DISC frame
+// and receive another DISC. If DISC was successful, Tx sends UA frame.
+// In full duplex Rx also waits for its frames to be acknowledged first.
+int closeConnection(int showStatistics) {
     unsigned char discFrame[5] = {FLAG, A_RECEIV, C_DISC, A_RECEIV ^ C_DISC, FLAG};
     unsigned char uaFrame[5] = {FLAG, A_RECEIV, C_UA, A_RECEIV ^ C_UA, FLAG};
-
-    (void)signal(SIGALRM, alarmHandler);
-    alarmCount = 0;
+    int received = 0;
+    Timer timer;
 
     if (parameters.role == LlTx) {
-        while (alarmCount < parameters.nRetransmissions) {
-            int bytesWritten = write(fd, discFrame, 5);
+        sendPendingAck();
+        if (flushWindow(0) != 0) {
+            printf("Transmitter failed to deliver pending frames\n");
+            return -1;
+        }
+
+        for (int attempt = 0; !received && attempt < parameters.nRetransmissions; attempt++) {
+            int bytesWritten = writePort(discFrame, 5);
             printf("Transmitter sent DISC frame bytes: %d\n", bytesWritten);
 
             if (bytesWritten != 5) {
@@ -455,79 +1747,19 @@ int llclose(int showStatistics) {
                 return -1;
             }
 
-            alarm(parameters.timeout);
-            waitAlarm = TRUE;
-
-            while (waitAlarm) {
-                int bytesRead = read(fd, &byte, 1);
-                if (bytesRead > 0) {
-
-                    switch (state) {
-                        case START:
-                            if (byte == FLAG) {
-                                state = FLAG_RCV;
-                            }
-                            break;
-
-                        case FLAG_RCV:
-                            if (byte == A_RECEIV) {
-                                state = A_RCV;
-                            } else if (byte != FLAG) {
-                                state = START;
-                            }
-                            break;
-
-                        case A_RCV:
-                            if (byte == C_DISC) {
-                                state = C_RCV;
-                            } else if (byte == FLAG) {
-                                state = FLAG_RCV;
-                            } else {
-                                state = START;
-                            }
-                            break;
-
-                        case C_RCV:
-                            if (byte == (A_RECEIV ^ C_DISC)) {
-                                state = BCC_OK;
-                            } else if (byte == FLAG) {
-                                state = FLAG_RCV;
-                            } else {
-                                state = START;
-                            }
-                            break;
-
-                        case BCC_OK:
-                            if (byte == FLAG) {
-                                state = STOP_STATE;
-                                waitAlarm = FALSE;
-                                alarm(0);
-                            } else {
-                                state = START;
-                            }
-                            break;
-
-                        default:
-                            state = START;
-                            break;
-                    }
-                } else if (bytesRead < 0) {
-                    perror("Error reading byte");
-                    return -1;
-                }
-            }
-
-            if (state == STOP_STATE) {
-                break;
+            timerStart(&timer, timeoutUs);
+            received = waitControlFrame(A_RECEIV, C_DISC, &timer);
+            if (received < 0) {
+                return -1;
             }
         }
 
-        if (state != STOP_STATE) {
+        if (!received) {
             printf("Transmitter failed to receive DISC frame\n");
             return -1;
         }
 
-        int bytesWritten = write(fd, uaFrame, 5);
+        int bytesWritten = writePort(uaFrame, 5);
         printf("Transmitter sent UA frame bytes: %d\n", bytesWritten);
 
         if (bytesWritten != 5) {
@@ -536,117 +1768,89 @@ int llclose(int showStatistics) {
         }
 
         if (showStatistics) {
-            gettimeofday(&end_time, NULL);
-            double executionTime = (end_time.tv_sec - start_time.tv_sec) + 
-                                    (end_time.tv_usec - start_time.tv_usec) / 1000000.0;
+            double executionTime = (timerNow() - startTime) / 1000000.0;
             double FER = (double)(retransmissions) / (double)(totalFramesSent);
             printf("=== Transmitter Statistics ===\n");
             printf("Total Execution Time: %.2f seconds\n", executionTime);
+            printf("Window Size: %d\n", windowSize);
+            printf("Maximum Payload: %d bytes\n", maxPayload);
+            printf("Frame Check: %s\n", frameCheckNames[frameCheck]);
             printf("Total Frames Sent: %u\n", totalFramesSent);
             printf("Total Retransmissions: %u\n", retransmissions);
             printf("Frame Error Rate (FER): %.2f\n", FER);
+            printf("Estimated RTT: %.2f ms (variation %.2f ms, min %.2f ms, max %.2f ms, %u samples)\n",
+                   rtt.srtt / 1000.0, rtt.rttvar / 1000.0, rtt.minRtt / 1000.0, rtt.maxRtt / 1000.0, rtt.samples);
+            printf("Retransmission Timeout: %.2f ms (%u backoffs)\n", rtt.rto / 1000.0, rtt.backoffs);
+            if (sizer.frames > 0) {
+                printf("Data Payload: %d to %d bytes, average %.0f, last %d (%u changes)\n",
+                       sizer.smallest, sizer.largest, (double)sizer.payloadBytes / sizer.frames,
+                       sizer.lastPayload, sizer.changes);
+            }
             printf("=============================\n");
         }
 
     } else if (parameters.role == LlRx) {
-        while (alarmCount < parameters.nRetransmissions) {
-            int bytesRead = read(fd, &byte, 1);
-            if (bytesRead > 0) {
-
-                switch (state) {
-                    case START:
-                        if (byte == FLAG) {
-                            state = FLAG_RCV;
-                        }
-                        break;
-
-                    case FLAG_RCV:
-                        if (byte == A_RECEIV) {
-                            state = A_RCV;
-                        } else if (byte != FLAG) {
-                            state = START;
-                        }
-                        break;
-
-                    case A_RCV:
-                        if (byte == C_DISC) {
-                            state = C_RCV;
-                        } else if (byte == FLAG) {
-                            state = FLAG_RCV;
-                        } else {
-                            state = START;
-                        }
-                        break;
-
-                    case C_RCV:
-                        if (byte == (A_RECEIV ^ C_DISC)) {
-                            state = BCC_OK;
-                        } else if (byte == FLAG) {
-                            state = FLAG_RCV;
-                        } else {
-                            state = START;
-                        }
-                        break;
-
-                    case BCC_OK:
-                        if (byte == FLAG) {
-                            state = STOP_STATE;
-                            waitAlarm = FALSE;
-                        } else {
-                            state = START;
-                        }
-                        break;
-
-                    default:
-                        state = START;
-                        break;
-                }
-            }
-
-            if (state == STOP_STATE) {
-                break;
-            }
+        sendPendingAck();
+        if (flushWindow(0) != 0) {
+            printf("Receiver failed to deliver pending frames\n");
+            return -1;
         }
 
-        if (state != STOP_STATE) {
+        // Waits for the DISC without a timeout, like llread
+        if (waitControlFrame(A_RECEIV, C_DISC, NULL) != 1) {
             printf("Receiver failed to receive DISC frame\n");
             return -1;
         }
 
-        int bytesWritten = write(fd, discFrame, 5);
-        printf("Receiver sent DISC frame bytes: %d\n", bytesWritten);
+        for (int attempt = 0; !received && attempt < parameters.nRetransmissions; attempt++) {
+            int bytesWritten = writePort(discFrame, 5);
+            printf("Receiver sent DISC frame bytes: %d\n", bytesWritten);
 
-        if (bytesWritten != 5) {
-            perror("Error sending DISC frame");
-            return -1;
-        }
-
-        alarm(parameters.timeout);
-        waitAlarm = TRUE;
+            if (bytesWritten != 5) {
+                perror("Error sending DISC frame");
+                return -1;
+            }
 
-        while (waitAlarm) {
-            int bytesRead = read(fd, &byte, 1);
-            if (bytesRead > 0) {
-                printf("Receiver received byte: %02X\n", byte);
-                if (byte == FLAG) {
-                    state = STOP_STATE;
-                    waitAlarm = FALSE;
+            // A repeated DISC means our DISC was lost
+            timerStart(&timer, timeoutUs);
+            while (!received && waitFrame(&timer) == 1) {
+                if (receiver.address != A_RECEIV) {
+                    continue;
+                }
+                if (receiver.control == C_UA) {
+                    printf("Receiver received UA frame\n");
+                    received = TRUE;
+                } else if (receiver.control == C_DISC) {
+                    break;
                 }
             }
         }
 
         if (showStatistics) {
-            unsigned int totalBitsTransferred = totalDataBytes * 8;
+            double totalBitsTransferred = totalDataBytes * 8.0;
             double bitrate = parameters.baudRate;
             double efficiency = (double)totalBitsTransferred / bitrate;
             printf("=== Receiver Statistics ===\n");
+            printf("Window Size: %d\n", windowSize);
             printf("Total Frames Received: %u\n", totalFramesReceived);
-            printf("Total Data Transferred: %u bytes\n", totalDataBytes);
+            printf("Total Data Transferred: %llu bytes\n", totalDataBytes);
             printf("Efficiency (S): %.2f\n", efficiency);
-            printf("Total Data Received: %u bytes\n", totalDataBytes);
+            printf("Total Data Received: %llu bytes\n", totalDataBytes);
+            if (fecMode != FecNone) {
+                printf("Corrected Frames: %u (%u bytes)\n", correctedFrames, correctedBytes);
+                printf("Uncorrectable Frames: %u\n", uncorrectableFrames);
+            }
             printf("============================\n");
         }
     }
+    vclockClose();
     int clstat = closeSerialPort();
     return clstat;
 }
+
+int llclose(int showStatistics) {
+    pthread_mutex_lock(&linkLock);
+    int result = closeConnection(showStatistics);
+    pthread_mutex_unlock(&linkLock);
+    return result;
+}
@@ -0,0 +1,164 @@
+// Block compression implementation
+// Each sequence is a token (literal length in the high nibble, match length - 4 in the
+// low one, 15 meaning more length bytes follow), the literals, and the match offset in
+// 2 bytes (least significant first). The last sequence only has literals.
+// Matches are found through a hash table of 4 byte prefixes, skipping ahead faster
+// while no match is found so incompressible data costs little.
+
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+// The last bytes are always literals and matches cannot start close to the end
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+static int hash(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes a length beyond the 15 of its nibble
+static int putLength(unsigned char *out, int op, int length)
+{
+    for (length -= 15; length >= 255; length -= 255) {
+        out[op++] = 255;
+    }
+    out[op++] = length;
+    return op;
+}
+
+// Writes a sequence of literals followed by a match (none if matchLength is 0).
+// Returns the new output position, or -1 if it does not fit.
+static int putSequence(unsigned char *out, int op, int capacity, const unsigned char *literals,
+                       int literalLength, int offset, int matchLength)
+{
+    int worstCase = 1 + literalLength / 255 + 1 + literalLength + 2 + matchLength / 255 + 1;
+    if (op + worstCase > capacity) {
+        return -1;
+    }
+
+    int matchCode = matchLength > 0 ? matchLength - LZ_MIN_MATCH : 0;
+    out[op++] = (literalLength < 15 ? literalLength : 15) << 4 | (matchCode < 15 ? matchCode : 15);
+    if (literalLength >= 15) {
+        op = putLength(out, op, literalLength);
+    }
+    memcpy(&out[op], literals, literalLength);
+    op += literalLength;
+
+    if (matchLength > 0) {
+        out[op++] = offset & 0xFF;
+        out[op++] = offset >> 8;
+        if (matchCode >= 15) {
+            op = putLength(out, op, matchCode);
+        }
+    }
+    return op;
+}
+
+int lzCompress(const unsigned char *in, int size, unsigned char *out, int capacity)
+{
+    int table[1 << LZ_HASH_BITS];
+    int ip = 0, anchor = 0, op = 0;
+
+    memset(table, 0xFF, sizeof(table));
+
+    while (ip < size - LZ_MATCH_LIMIT) {
+        uint32_t sequence = read32(&in[ip]);
+        int h = hash(sequence);
+        int ref = table[h];
+        table[h] = ip;
+
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || read32(&in[ref]) != sequence) {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        int matchLength = LZ_MIN_MATCH;
+        int maxLength = size - LZ_LAST_LITERALS - ip;
+        while (matchLength < maxLength && in[ref + matchLength] == in[ip + matchLength]) {
+            matchLength++;
+        }
+
+        op = putSequence(out, op, capacity, &in[anchor], ip - anchor, ip - ref, matchLength);
+        if (op < 0) {
+            return 0;
+        }
+        ip += matchLength;
+        anchor = ip;
+    }
+
+    op = putSequence(out, op, capacity, &in[anchor], size - anchor, 0, 0);
+    return op < 0 ? 0 : op;
+}
+
+// Reads a length beyond the 15 of its nibble. Returns -1 past the end of the input.
+static int getLength(const unsigned char *in, int size, int *ip)
+{
+    int length = 15;
+    unsigned char byte;
+    do {
+        if (*ip >= size) {
+            return -1;
+        }
+        byte = in[(*ip)++];
+        length += byte;
+    } while (byte == 255 && length < (1 << 30));
+    return length;
+}
+
+int lzDecompress(const unsigned char *in, int size, unsigned char *out, int capacity)
+{
+    int ip = 0, op = 0;
+
+    while (ip < size) {
+        unsigned char token = in[ip++];
+
+        int literalLength = token >> 4;
+        if (literalLength == 15 && (literalLength = getLength(in, size, &ip)) < 0) {
+            return -1;
+        }
+        if (literalLength > size - ip || literalLength > capacity - op) {
+            return -1;
+        }
+        memcpy(&out[op], &in[ip], literalLength);
+        ip += literalLength;
+        op += literalLength;
+
+        // The last sequence ends with its literals
+        if (ip == size) {
+            break;
+        }
+
+        if (ip + 2 > size) {
+            return -1;
+        }
+        int offset = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+
+        int matchLength = token & 0x0F;
+        if (matchLength == 15 && (matchLength = getLength(in, size, &ip)) < 0) {
+            return -1;
+        }
+        matchLength += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op || matchLength > capacity - op) {
+            return -1;
+        }
+        // Byte by byte, since the match may overlap the bytes it produces
+        for (int i = 0; i < matchLength; i++, op++) {
+            out[op] = out[op - offset];
+        }
+    }
+    return op;
+}
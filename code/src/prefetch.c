@@ -0,0 +1,89 @@
+// File prefetch implementation
+// Touching one byte per page makes the reader thread take the page faults (and wait
+// for the disk) instead of the transmitter.
+
+#include "prefetch.h"
+#include <sys/mman.h>
+#include <unistd.h>
+
+static void *readerThread(void *arg)
+{
+    Prefetcher *prefetcher = arg;
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t offset = prefetcher->start;
+    int size;
+
+    do {
+        sem_wait(&prefetcher->free);
+        PrefetchChunk *chunk = &prefetcher->slots[prefetcher->readIdx];
+        size_t left = prefetcher->fileSize - offset;
+        size = left < (size_t)prefetcher->chunkSize ? (int)left : prefetcher->chunkSize;
+
+        volatile unsigned char sink = 0;
+        for (int i = 0; i < size; i += pageSize) {
+            sink ^= prefetcher->map[offset + i];
+        }
+        (void)sink;
+
+        chunk->data = prefetcher->map + offset;
+        chunk->size = size;
+        offset += size;
+        prefetcher->readIdx = (prefetcher->readIdx + 1) % PREFETCH_SLOTS;
+        sem_post(&prefetcher->filled);
+    } while (size > 0);
+
+    return NULL;
+}
+
+int prefetchStart(Prefetcher *prefetcher, int fd, size_t fileSize, size_t start, int chunkSize)
+{
+    prefetcher->map = NULL;
+    prefetcher->fileSize = fileSize;
+    prefetcher->start = start < fileSize ? start : fileSize;
+    prefetcher->chunkSize = chunkSize;
+    prefetcher->readIdx = 0;
+    prefetcher->sendIdx = 0;
+
+    // Empty files cannot be mapped
+    if (fileSize > 0) {
+        void *map = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        madvise(map, fileSize, MADV_SEQUENTIAL);
+        prefetcher->map = map;
+    }
+
+    sem_init(&prefetcher->filled, 0, 0);
+    sem_init(&prefetcher->free, 0, PREFETCH_SLOTS);
+
+    if (pthread_create(&prefetcher->thread, NULL, readerThread, prefetcher) != 0) {
+        if (prefetcher->map != NULL) {
+            munmap((void *)prefetcher->map, fileSize);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+PrefetchChunk *prefetchNext(Prefetcher *prefetcher)
+{
+    sem_wait(&prefetcher->filled);
+    return &prefetcher->slots[prefetcher->sendIdx];
+}
+
+void prefetchRelease(Prefetcher *prefetcher)
+{
+    prefetcher->sendIdx = (prefetcher->sendIdx + 1) % PREFETCH_SLOTS;
+    sem_post(&prefetcher->free);
+}
+
+void prefetchStop(Prefetcher *prefetcher)
+{
+    pthread_join(prefetcher->thread, NULL);
+    sem_destroy(&prefetcher->filled);
+    sem_destroy(&prefetcher->free);
+    if (prefetcher->map != NULL) {
+        munmap((void *)prefetcher->map, prefetcher->fileSize);
+    }
+}
@@ -0,0 +1,255 @@
+// Reed-Solomon implementation
+// GF(256) with the primitive polynomial x^8 + x^4 + x^3 + x^2 + 1; the generator has
+// the roots alpha^0 to alpha^31. Codewords shorter than 255 bytes are shortened codes
+// (leading zeros that are not sent). Decoding uses Berlekamp-Massey, a Chien search
+// and Forney's algorithm.
+
+#include "rs.h"
+#include <string.h>
+
+#define GF_POLY 0x11D
+
+static unsigned char gfExp[512];
+static unsigned char gfLog[256];
+// Row f holds f times the generator coefficients, in the order the encoder uses them
+static unsigned char generatorRows[256][RS_PARITY_SIZE];
+static int tablesReady = 0;
+
+static unsigned char gfMul(unsigned char a, unsigned char b)
+{
+    return a == 0 || b == 0 ? 0 : gfExp[gfLog[a] + gfLog[b]];
+}
+
+static unsigned char gfDiv(unsigned char a, unsigned char b)
+{
+    return a == 0 ? 0 : gfExp[gfLog[a] + 255 - gfLog[b]];
+}
+
+static void initTables()
+{
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gfExp[i] = gfExp[i + 255] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= GF_POLY;
+        }
+    }
+
+    // Generator polynomial, coefficient of x^i in generator[i]
+    unsigned char generator[RS_PARITY_SIZE + 1] = {1};
+    for (int root = 0; root < RS_PARITY_SIZE; root++) {
+        for (int j = root + 1; j > 0; j--) {
+            generator[j] = generator[j - 1] ^ gfMul(generator[j], gfExp[root]);
+        }
+        generator[0] = gfMul(generator[0], gfExp[root]);
+    }
+
+    for (int f = 0; f < 256; f++) {
+        for (int j = 0; j < RS_PARITY_SIZE; j++) {
+            generatorRows[f][j] = gfMul(f, generator[RS_PARITY_SIZE - 1 - j]);
+        }
+    }
+
+    tablesReady = 1;
+}
+
+void rsEncodeStart(RsEncoder *encoder, int size)
+{
+    if (!tablesReady) {
+        initTables();
+    }
+    encoder->codewords = RS_CODEWORDS(size);
+    encoder->next = 0;
+    memset(encoder->parity, 0, (size_t)encoder->codewords * RS_PARITY_SIZE);
+}
+
+// Each codeword keeps the remainder of its data divided by the generator, highest
+// degree first, updated as its bytes arrive
+void rsEncodeUpdate(RsEncoder *encoder, const unsigned char *data, int size)
+{
+    for (int i = 0; i < size; i++) {
+        unsigned char *parity = encoder->parity[encoder->next];
+        const unsigned char *row = generatorRows[data[i] ^ parity[0]];
+        for (int j = 0; j < RS_PARITY_SIZE - 1; j++) {
+            parity[j] = parity[j + 1] ^ row[j];
+        }
+        parity[RS_PARITY_SIZE - 1] = row[RS_PARITY_SIZE - 1];
+
+        if (++encoder->next == encoder->codewords) {
+            encoder->next = 0;
+        }
+    }
+}
+
+int rsEncodeFinish(RsEncoder *encoder, unsigned char *parity)
+{
+    int codewords = encoder->codewords;
+    for (int c = 0; c < codewords; c++) {
+        for (int j = 0; j < RS_PARITY_SIZE; j++) {
+            parity[j * codewords + c] = encoder->parity[c][j];
+        }
+    }
+    return codewords * RS_PARITY_SIZE;
+}
+
+// Every codeword but the last carries RS_DATA_SIZE bytes, so the encoded size gives the
+// number of codewords back
+int rsDataSize(int size)
+{
+    int codewords = (size + RS_CODEWORD_SIZE - 1) / RS_CODEWORD_SIZE;
+    int dataSize = size - codewords * RS_PARITY_SIZE;
+    if (codewords > RS_MAX_CODEWORDS || dataSize < codewords || RS_CODEWORDS(dataSize) != codewords) {
+        return -1;
+    }
+    return dataSize;
+}
+
+// Value of the polynomial with the given coefficients (of x^i in poly[i]) at x
+static unsigned char evaluate(const unsigned char *poly, int degree, unsigned char x)
+{
+    unsigned char value = 0;
+    for (int i = degree; i >= 0; i--) {
+        value = gfMul(value, x) ^ poly[i];
+    }
+    return value;
+}
+
+// Corrects a codeword of size bytes, the first one of degree size - 1.
+// Returns the number of bytes corrected, or -1 if there are too many errors.
+static int decodeCodeword(unsigned char *codeword, int size)
+{
+    unsigned char syndromes[RS_PARITY_SIZE];
+    int clean = 1;
+    for (int i = 0; i < RS_PARITY_SIZE; i++) {
+        unsigned char s = 0;
+        for (int p = 0; p < size; p++) {
+            s = (s == 0 ? 0 : gfExp[gfLog[s] + i]) ^ codeword[p];
+        }
+        syndromes[i] = s;
+        clean &= s == 0;
+    }
+    if (clean) {
+        return 0;
+    }
+
+    // Berlekamp-Massey: error locator lambda, whose roots are the inverses of the
+    // error locations
+    unsigned char lambda[RS_PARITY_SIZE + 1] = {1};
+    unsigned char previous[RS_PARITY_SIZE + 1] = {1};
+    unsigned char saved[RS_PARITY_SIZE + 1];
+    unsigned char previousDiscrepancy = 1;
+    int errors = 0, shift = 1;
+
+    for (int n = 0; n < RS_PARITY_SIZE; n++) {
+        unsigned char discrepancy = syndromes[n];
+        for (int i = 1; i <= errors; i++) {
+            discrepancy ^= gfMul(lambda[i], syndromes[n - i]);
+        }
+        if (discrepancy == 0) {
+            shift++;
+            continue;
+        }
+
+        unsigned char factor = gfDiv(discrepancy, previousDiscrepancy);
+        memcpy(saved, lambda, sizeof(lambda));
+        for (int i = 0; i + shift <= RS_PARITY_SIZE; i++) {
+            lambda[i + shift] ^= gfMul(factor, previous[i]);
+        }
+        if (2 * errors <= n) {
+            errors = n + 1 - errors;
+            memcpy(previous, saved, sizeof(previous));
+            previousDiscrepancy = discrepancy;
+            shift = 1;
+        } else {
+            shift++;
+        }
+    }
+    if (errors > RS_PARITY_SIZE / 2) {
+        return -1;
+    }
+
+    // Chien search over the positions actually sent
+    int positions[RS_PARITY_SIZE / 2];
+    int found = 0;
+    for (int p = 0; p < size; p++) {
+        int degree = size - 1 - p;
+        if (evaluate(lambda, errors, gfExp[255 - degree]) == 0) {
+            if (found == errors) {
+                return -1;
+            }
+            positions[found++] = p;
+        }
+    }
+    if (found != errors) {
+        return -1;
+    }
+
+    // Forney: error evaluator omega = syndromes * lambda mod x^32
+    unsigned char omega[RS_PARITY_SIZE];
+    for (int i = 0; i < RS_PARITY_SIZE; i++) {
+        omega[i] = 0;
+        for (int j = 0; j <= i && j <= errors; j++) {
+            omega[i] ^= gfMul(syndromes[i - j], lambda[j]);
+        }
+    }
+
+    for (int k = 0; k < found; k++) {
+        int degree = size - 1 - positions[k];
+        unsigned char inverse = gfExp[255 - degree];
+
+        // Formal derivative of lambda: only the odd powers remain
+        unsigned char derivative = 0;
+        for (int i = 1; i <= errors; i += 2) {
+            derivative ^= gfMul(lambda[i], gfExp[(gfLog[inverse] * (i - 1)) % 255]);
+        }
+        if (derivative == 0) {
+            return -1;
+        }
+
+        unsigned char value = gfDiv(evaluate(omega, RS_PARITY_SIZE - 1, inverse), derivative);
+        codeword[positions[k]] ^= gfMul(gfExp[degree], value);
+    }
+    return found;
+}
+
+int rsDecode(unsigned char *block, int size)
+{
+    int dataSize = rsDataSize(size);
+    if (dataSize < 0) {
+        return -1;
+    }
+    if (!tablesReady) {
+        initTables();
+    }
+
+    int codewords = RS_CODEWORDS(dataSize);
+    int corrected = 0;
+    for (int c = 0; c < codewords; c++) {
+        unsigned char codeword[RS_CODEWORD_SIZE];
+        int n = 0;
+        for (int i = c; i < dataSize; i += codewords) {
+            codeword[n++] = block[i];
+        }
+        for (int j = 0; j < RS_PARITY_SIZE; j++) {
+            codeword[n++] = block[dataSize + j * codewords + c];
+        }
+
+        int errors = decodeCodeword(codeword, n);
+        if (errors < 0) {
+            return -1;
+        }
+        if (errors > 0) {
+            n = 0;
+            for (int i = c; i < dataSize; i += codewords) {
+                block[i] = codeword[n++];
+            }
+            for (int j = 0; j < RS_PARITY_SIZE; j++) {
+                block[dataSize + j * codewords + c] = codeword[n++];
+            }
+            corrected += errors;
+        }
+    }
+    return corrected;
+}
@@ -0,0 +1,55 @@
+// Round trip time estimator implementation
+
+#include "rtt.h"
+
+static long long clampRto(long long rto)
+{
+    if (rto < RTT_MIN_RTO) {
+        return RTT_MIN_RTO;
+    }
+    return rto > RTT_MAX_RTO ? RTT_MAX_RTO : rto;
+}
+
+void rttInit(RttEstimator *est, long long initialRto)
+{
+    est->srtt = 0;
+    est->rttvar = 0;
+    est->rto = clampRto(initialRto);
+    est->minRtt = 0;
+    est->maxRtt = 0;
+    est->samples = 0;
+    est->backoffs = 0;
+}
+
+void rttSample(RttEstimator *est, long long rtt)
+{
+    if (rtt < 0) {
+        rtt = 0;
+    }
+
+    if (est->samples == 0) {
+        est->srtt = rtt;
+        est->rttvar = rtt / 2;
+        est->minRtt = est->maxRtt = rtt;
+    } else {
+        long long error = est->srtt > rtt ? est->srtt - rtt : rtt - est->srtt;
+        // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R
+        est->rttvar += (error - est->rttvar) / 4;
+        est->srtt += (rtt - est->srtt) / 8;
+        if (rtt < est->minRtt) {
+            est->minRtt = rtt;
+        }
+        if (rtt > est->maxRtt) {
+            est->maxRtt = rtt;
+        }
+    }
+
+    est->samples++;
+    est->rto = clampRto(est->srtt + 4 * est->rttvar);
+}
+
+void rttBackoff(RttEstimator *est)
+{
+    est->backoffs++;
+    est->rto = clampRto(est->rto * 2);
+}
@@ -0,0 +1,307 @@
+// Byte stuffing implementation
+// Clean runs of bytes are found with SSE2/AVX2 compares and copied in bulk,
+// with table-driven scalar loops for other CPUs and for the tail of the data.
+
+#include "stuffing.h"
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define STUFFING_X86 1
+#endif
+
+// Bytes that must be escaped
+static const unsigned char reservedByte[256] = {
+    [STUFF_FLAG] = 1,
+    [STUFF_ESCAPE] = 1,
+};
+
+// Stuffs bytes one at a time without branching on their value: both output positions
+// are always written (the second one is overwritten by the next byte when no escape is
+// needed), which stays within the 2 * size bytes of out.
+static unsigned char *stuffDense(unsigned char *out, const unsigned char *data, int size)
+{
+    for (int i = 0; i < size; i++) {
+        unsigned char byte = data[i];
+        unsigned char reserved = reservedByte[byte];
+        out[0] = reserved ? STUFF_ESCAPE : byte;
+        out[1] = byte ^ STUFF_XOR;
+        out += 1 + reserved;
+    }
+    return out;
+}
+
+static int stuffScalar(unsigned char *out, const unsigned char *data, int size, unsigned char *bcc2)
+{
+    unsigned char acc = *bcc2;
+
+    for (int i = 0; i < size; i++) {
+        acc ^= data[i];
+    }
+
+    *bcc2 = acc;
+    return stuffDense(out, data, size) - out;
+}
+
+#ifdef STUFFING_X86
+
+// Copies a block of n bytes, escaping the bytes whose bit is set in mask.
+// Sparse escapes split the block into bulk copies; dense ones go byte by byte.
+static unsigned char *stuffBlock(unsigned char *out, const unsigned char *data, int n, unsigned int mask)
+{
+    int pos = 0;
+
+    if (__builtin_popcount(mask) > 2) {
+        return stuffDense(out, data, n);
+    }
+
+    while (mask != 0) {
+        int reserved = __builtin_ctz(mask);
+        memcpy(out, data + pos, reserved - pos);
+        out += reserved - pos;
+        *out++ = STUFF_ESCAPE;
+        *out++ = data[reserved] ^ STUFF_XOR;
+        pos = reserved + 1;
+        mask &= mask - 1;
+    }
+
+    memcpy(out, data + pos, n - pos);
+    return out + n - pos;
+}
+
+static unsigned char foldXor(const unsigned char *lanes, int n)
+{
+    unsigned char acc = 0;
+    for (int i = 0; i < n; i++) {
+        acc ^= lanes[i];
+    }
+    return acc;
+}
+
+static int stuffSSE2(unsigned char *out, const unsigned char *data, int size, unsigned char *bcc2)
+{
+    const __m128i flag = _mm_set1_epi8(STUFF_FLAG);
+    const __m128i escape = _mm_set1_epi8(STUFF_ESCAPE);
+    __m128i acc = _mm_setzero_si128();
+    unsigned char *start = out;
+    unsigned char lanes[16];
+    int i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        acc = _mm_xor_si128(acc, block);
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, flag),
+                                                           _mm_cmpeq_epi8(block, escape)));
+        if (mask == 0) {
+            _mm_storeu_si128((__m128i *)out, block);
+            out += 16;
+        } else if (mask == 0xFFFF) {
+            // Every byte is escaped: interleave ESCAPE with the XORed bytes
+            __m128i escaped = _mm_xor_si128(block, _mm_set1_epi8(STUFF_XOR));
+            _mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi8(escape, escaped));
+            _mm_storeu_si128((__m128i *)(out + 16), _mm_unpackhi_epi8(escape, escaped));
+            out += 32;
+        } else {
+            out = stuffBlock(out, data + i, 16, mask);
+        }
+    }
+
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    *bcc2 ^= foldXor(lanes, 16);
+    return (out - start) + stuffScalar(out, data + i, size - i, bcc2);
+}
+
+__attribute__((target("avx2")))
+static int stuffAVX2(unsigned char *out, const unsigned char *data, int size, unsigned char *bcc2)
+{
+    const __m256i flag = _mm256_set1_epi8(STUFF_FLAG);
+    const __m256i escape = _mm256_set1_epi8(STUFF_ESCAPE);
+    __m256i acc = _mm256_setzero_si256();
+    unsigned char *start = out;
+    unsigned char lanes[32];
+    int i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+        acc = _mm256_xor_si256(acc, block);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(block, flag),
+                                                                 _mm256_cmpeq_epi8(block, escape)));
+        if (mask == 0) {
+            _mm256_storeu_si256((__m256i *)out, block);
+            out += 32;
+        } else if (mask == 0xFFFFFFFF) {
+            // Every byte is escaped: interleave ESCAPE with the XORed bytes (unpack works
+            // within 128-bit lanes, so the halves are put back in order)
+            __m256i escaped = _mm256_xor_si256(block, _mm256_set1_epi8(STUFF_XOR));
+            __m256i low = _mm256_unpacklo_epi8(escape, escaped);
+            __m256i high = _mm256_unpackhi_epi8(escape, escaped);
+            _mm256_storeu_si256((__m256i *)out, _mm256_permute2x128_si256(low, high, 0x20));
+            _mm256_storeu_si256((__m256i *)(out + 32), _mm256_permute2x128_si256(low, high, 0x31));
+            out += 64;
+        } else {
+            out = stuffBlock(out, data + i, 32, mask);
+        }
+    }
+
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    *bcc2 ^= foldXor(lanes, 32);
+    return (out - start) + stuffSSE2(out, data + i, size - i, bcc2);
+}
+
+#endif // STUFFING_X86
+
+// Copies bytes until the first reserved one, XORing them into *bcc2.
+// Returns the number of bytes copied.
+static int copyRunScalar(unsigned char *out, const unsigned char *in, int size, unsigned char *bcc2)
+{
+    unsigned char acc = *bcc2;
+    int i = 0;
+
+    for (; i < size && !reservedByte[in[i]]; i++) {
+        out[i] = in[i];
+        acc ^= in[i];
+    }
+
+    *bcc2 = acc;
+    return i;
+}
+
+#ifdef STUFFING_X86
+
+// Whole blocks are stored before checking them, so out may receive bytes past the
+// run; they are overwritten by the caller, and size bounds both buffers.
+static int copyRunSSE2(unsigned char *out, const unsigned char *in, int size, unsigned char *bcc2)
+{
+    const __m128i flag = _mm_set1_epi8(STUFF_FLAG);
+    const __m128i escape = _mm_set1_epi8(STUFF_ESCAPE);
+    __m128i acc = _mm_setzero_si128();
+    unsigned char lanes[16];
+    int i = 0, run = -1;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(in + i));
+        _mm_storeu_si128((__m128i *)(out + i), block);
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, flag),
+                                                           _mm_cmpeq_epi8(block, escape)));
+        if (mask != 0) {
+            run = i + __builtin_ctz(mask);
+            break;
+        }
+        acc = _mm_xor_si128(acc, block);
+    }
+
+    if (i > 0) {
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        *bcc2 ^= foldXor(lanes, 16);
+    }
+
+    if (run >= 0) {
+        *bcc2 ^= foldXor(in + i, run - i);
+        return run;
+    }
+    return i + copyRunScalar(out + i, in + i, size - i, bcc2);
+}
+
+__attribute__((target("avx2")))
+static int copyRunAVX2(unsigned char *out, const unsigned char *in, int size, unsigned char *bcc2)
+{
+    const __m256i flag = _mm256_set1_epi8(STUFF_FLAG);
+    const __m256i escape = _mm256_set1_epi8(STUFF_ESCAPE);
+    __m256i acc = _mm256_setzero_si256();
+    unsigned char lanes[32];
+    int i = 0, run = -1;
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(in + i));
+        _mm256_storeu_si256((__m256i *)(out + i), block);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(block, flag),
+                                                                 _mm256_cmpeq_epi8(block, escape)));
+        if (mask != 0) {
+            run = i + __builtin_ctz(mask);
+            break;
+        }
+        acc = _mm256_xor_si256(acc, block);
+    }
+
+    if (i > 0) {
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        *bcc2 ^= foldXor(lanes, 32);
+    }
+
+    if (run >= 0) {
+        *bcc2 ^= foldXor(in + i, run - i);
+        return run;
+    }
+    return i + copyRunSSE2(out + i, in + i, size - i, bcc2);
+}
+
+#endif // STUFFING_X86
+
+typedef int (*StuffFunction)(unsigned char *, const unsigned char *, int, unsigned char *);
+
+// Implementations picked for the widest vectors the CPU supports
+static StuffFunction stuff = NULL;
+static StuffFunction copyRun = NULL;
+
+static void selectImplementation()
+{
+#ifdef STUFFING_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        stuff = stuffAVX2;
+        copyRun = copyRunAVX2;
+    } else {
+        stuff = stuffSSE2;
+        copyRun = copyRunSSE2;
+    }
+#else
+    stuff = stuffScalar;
+    copyRun = copyRunScalar;
+#endif
+}
+
+int stuffBytes(unsigned char *out, const unsigned char *data, int size, unsigned char *bcc2)
+{
+    if (stuff == NULL) {
+        selectImplementation();
+    }
+    return stuff(out, data, size, bcc2);
+}
+
+int destuffBytes(unsigned char *out, int outCapacity, int *outSize,
+                 const unsigned char *in, int size, unsigned char *bcc2)
+{
+    int i = 0, o = 0;
+
+    if (copyRun == NULL) {
+        selectImplementation();
+    }
+
+    while (i < size && o < outCapacity) {
+        // Escapes are often back to back, so only clean bytes start a bulk copy
+        if (!reservedByte[in[i]]) {
+            int limit = size - i < outCapacity - o ? size - i : outCapacity - o;
+            int run = copyRun(out + o, in + i, limit, bcc2);
+            i += run;
+            o += run;
+            if (run == limit) {
+                break;
+            }
+        }
+
+        if (in[i] != STUFF_ESCAPE || i + 1 >= size) {
+            break;
+        }
+
+        unsigned char escaped = in[i + 1];
+        if (escaped != (STUFF_FLAG ^ STUFF_XOR) && escaped != (STUFF_ESCAPE ^ STUFF_XOR)) {
+            break;
+        }
+        out[o++] = escaped ^ STUFF_XOR;
+        *bcc2 ^= escaped ^ STUFF_XOR;
+        i += 2;
+    }
+
+    *outSize = o;
+    return i;
+}
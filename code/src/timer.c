@@ -0,0 +1,55 @@
+// Timer implementation
+
+#include "timer.h"
+#include "link_layer.h"
+#include "vclock.h"
+#include <time.h>
+
+long long timerNow()
+{
+    if (vclockActive()) {
+        return vclockNow();
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void timerStart(Timer *timer, long long durationUs)
+{
+    timer->deadline = timerNow() + durationUs;
+    timer->active = TRUE;
+}
+
+void timerStop(Timer *timer)
+{
+    timer->active = FALSE;
+}
+
+int timerExpired(const Timer *timer, long long now)
+{
+    return timer->active && timer->deadline <= now;
+}
+
+int timerPollTimeout(const Timer *timer, long long now)
+{
+    if (!timer->active) {
+        return -1;
+    }
+    if (timer->deadline <= now) {
+        return 0;
+    }
+    return (int)((timer->deadline - now + 999) / 1000);
+}
+
+int timerMinTimeout(int timeoutMs, int otherMs)
+{
+    if (timeoutMs < 0) {
+        return otherMs;
+    }
+    if (otherMs < 0) {
+        return timeoutMs;
+    }
+    return otherMs < timeoutMs ? otherMs : timeoutMs;
+}
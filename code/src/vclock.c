@@ -0,0 +1,143 @@
+// Virtual clock implementation
+
+#define _GNU_SOURCE // ppoll
+#include "vclock.h"
+#include "link_layer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static VirtualClock *vclock = NULL;
+static int vclockPort = 0;
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+#define ADD(x, v) __atomic_add_fetch(&(x), (v), __ATOMIC_SEQ_CST)
+
+int vclockOpen(int port)
+{
+    const char *path = getenv(VCLOCK_ENV);
+    if (path == NULL || vclock != NULL) {
+        return 0;
+    }
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    void *map = mmap(NULL, sizeof(VirtualClock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error mapping the virtual clock");
+        return -1;
+    }
+
+    // Bytes moved by an earlier process on the port do not count
+    vclock = map;
+    vclockPort = port;
+    STORE(vclock->port[port].written, LOAD(vclock->port[port].received));
+    STORE(vclock->port[port].read, LOAD(vclock->port[port].delivered));
+    STORE(vclock->port[port].wakeAt, -1LL);
+    STORE(vclock->port[port].attached, TRUE);
+    printf("Using virtual clock %s\n", path);
+    return 0;
+}
+
+void vclockClose()
+{
+    if (vclock != NULL) {
+        STORE(vclock->port[vclockPort].attached, FALSE);
+        munmap(vclock, sizeof(VirtualClock));
+        vclock = NULL;
+    }
+}
+
+int vclockActive()
+{
+    return vclock != NULL;
+}
+
+long long vclockNow()
+{
+    return LOAD(vclock->now) / 1000;
+}
+
+// Waits in short real time slices, until the port has data or the cable moves the
+// clock past the end of the wait
+int vclockPoll(struct pollfd *pfd, int timeoutMs)
+{
+    if (vclock == NULL || timeoutMs == 0) {
+        return poll(pfd, 1, timeoutMs);
+    }
+
+    long long wakeAt = timeoutMs < 0 ? -1 : LOAD(vclock->now) + timeoutMs * 1000000LL;
+    STORE(vclock->port[vclockPort].wakeAt, wakeAt);
+    ADD(vclock->port[vclockPort].polling, 1);
+    ADD(vclock->port[vclockPort].changes, 1);
+
+    struct timespec tick = {.tv_sec = 0, .tv_nsec = VCLOCK_TICK};
+    int ready;
+    while ((ready = ppoll(pfd, 1, &tick, NULL)) == 0 && (wakeAt < 0 || LOAD(vclock->now) < wakeAt)) {
+    }
+
+    ADD(vclock->port[vclockPort].polling, -1);
+    ADD(vclock->port[vclockPort].changes, 1);
+    return ready;
+}
+
+// The bytes count as written before they are, so the cable waits for them. The port
+// is written without blocking, so the cable only moves the clock while it is full.
+int vclockWrite(int fd, const unsigned char *bytes, int size)
+{
+    if (vclock == NULL) {
+        return write(fd, bytes, size);
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    ADD(vclock->port[vclockPort].writing, 1);
+    ADD(vclock->port[vclockPort].changes, 1);
+    ADD(vclock->port[vclockPort].written, size);
+
+    int total = 0;
+    while (total < size) {
+        int bytesWritten = write(fd, bytes + total, size - total);
+        if (bytesWritten > 0) {
+            total += bytesWritten;
+            continue;
+        }
+        if (bytesWritten < 0 && errno != EAGAIN) {
+            break;
+        }
+
+        struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+        struct timespec tick = {.tv_sec = 0, .tv_nsec = VCLOCK_TICK};
+        ADD(vclock->port[vclockPort].blocked, 1);
+        ADD(vclock->port[vclockPort].writing, -1);
+        ADD(vclock->port[vclockPort].changes, 1);
+        while (ppoll(&pfd, 1, &tick, NULL) == 0) {
+        }
+        ADD(vclock->port[vclockPort].writing, 1);
+        ADD(vclock->port[vclockPort].blocked, -1);
+        ADD(vclock->port[vclockPort].changes, 1);
+    }
+
+    ADD(vclock->port[vclockPort].written, total - size);
+    ADD(vclock->port[vclockPort].writing, -1);
+    ADD(vclock->port[vclockPort].changes, 1);
+    fcntl(fd, F_SETFL, flags);
+    return total > 0 || size == 0 ? total : -1;
+}
+
+void vclockRead(int bytes)
+{
+    if (vclock != NULL && bytes > 0) {
+        ADD(vclock->port[vclockPort].read, bytes);
+    }
+}
@@ -0,0 +1,116 @@
+// Write-behind implementation
+// msync is only called from the flusher thread, so the link layer keeps receiving
+// while pages are written to disk.
+
+#include "writeback.h"
+#include "link_layer.h"
+#include <errno.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static void *flusherThread(void *arg)
+{
+    WriteBack *wb = arg;
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    long result = 0;
+
+    pthread_mutex_lock(&wb->lock);
+    while (TRUE) {
+        // Waits for something to be received, then for a chunk or the interval
+        while (!wb->done && wb->ready == wb->flushed) {
+            pthread_cond_wait(&wb->cond, &wb->lock);
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += WRITEBACK_INTERVAL_MS / 1000;
+        deadline.tv_nsec += (WRITEBACK_INTERVAL_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while (!wb->done && wb->ready - wb->flushed < WRITEBACK_CHUNK) {
+            if (pthread_cond_timedwait(&wb->cond, &wb->lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        size_t ready = wb->ready;
+        int done = wb->done;
+        pthread_mutex_unlock(&wb->lock);
+
+        // msync needs a page aligned start; the page holding the end of the
+        // previous flush is flushed again
+        size_t start = wb->flushed - wb->flushed % pageSize;
+        if (ready > start && msync(wb->map + start, ready - start, MS_SYNC) != 0) {
+            perror("Error flushing output file");
+            result = -1;
+        } else if (wb->onFlushed != NULL && ready > wb->flushed) {
+            wb->onFlushed(wb->context, ready);
+        }
+
+        pthread_mutex_lock(&wb->lock);
+        wb->flushed = ready;
+        if (done) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wb->lock);
+
+    return (void *)result;
+}
+
+int writebackStart(WriteBack *wb, unsigned char *map, size_t size, size_t start,
+                   WriteBackCallback onFlushed, void *context)
+{
+    pthread_condattr_t attr;
+
+    wb->map = map;
+    wb->size = size;
+    wb->ready = start;
+    wb->flushed = start;
+    wb->done = FALSE;
+    wb->onFlushed = onFlushed;
+    wb->context = context;
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wb->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&wb->thread, NULL, flusherThread, wb) != 0) {
+        pthread_mutex_destroy(&wb->lock);
+        pthread_cond_destroy(&wb->cond);
+        return -1;
+    }
+    return 0;
+}
+
+void writebackAdvance(WriteBack *wb, size_t ready)
+{
+    pthread_mutex_lock(&wb->lock);
+    // The flusher waits for the first bytes after a flush, then for a whole chunk
+    int first = wb->ready == wb->flushed;
+    wb->ready = ready > wb->size ? wb->size : ready;
+    if ((first && wb->ready > wb->flushed) || wb->ready - wb->flushed >= WRITEBACK_CHUNK) {
+        pthread_cond_signal(&wb->cond);
+    }
+    pthread_mutex_unlock(&wb->lock);
+}
+
+int writebackFinish(WriteBack *wb)
+{
+    void *result;
+
+    pthread_mutex_lock(&wb->lock);
+    wb->done = TRUE;
+    pthread_cond_signal(&wb->cond);
+    pthread_mutex_unlock(&wb->lock);
+
+    pthread_join(wb->thread, &result);
+    pthread_mutex_destroy(&wb->lock);
+    pthread_cond_destroy(&wb->cond);
+    return result == NULL ? 0 : -1;
+}